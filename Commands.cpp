@@ -2,14 +2,30 @@
 #include <string.h>
 #include <iostream>
 #include <vector>
-#include <sstream>
 #include <fcntl.h>
 #include <sys/wait.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/mman.h>
 #include <iomanip>
+#include <algorithm>
 #include <errno.h>
 #include <sched.h>
+#include <glob.h>
+#include <spawn.h>
+#include <signal.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/file.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <fstream>
+#include <sstream>
+#include <functional>
+#include <thread>
 #include "Commands.h"
 
 using namespace std;
@@ -27,104 +43,301 @@ const std::string WHITESPACE = " \n\r\t\f\v";
 #define FUNC_EXIT()
 #endif
 
-string _ltrim(const std::string& s)
-{
-  size_t start = s.find_first_not_of(WHITESPACE);
-  return (start == std::string::npos) ? "" : s.substr(start);
-}
+// ============================ Lexer ============================= //
+Arena::Arena(size_t capacity) : head(nullptr), initial_capacity(capacity) {}
 
-string _rtrim(const std::string& s)
-{
-  size_t end = s.find_last_not_of(WHITESPACE);
-  return (end == std::string::npos) ? "" : s.substr(0, end + 1);
+Arena::~Arena() {
+  while(head) {
+    Block* next = head->next;
+    free(head);
+    head = next;
+  }
 }
 
-string _trim(const std::string& s)
-{
-  return _rtrim(_ltrim(s));
+Arena::Block* Arena::newBlock(size_t capacity) {
+  Block* block = (Block*)malloc(sizeof(Block) + capacity);
+  if(block == nullptr) {
+    perror("smash error: malloc failed");
+    return nullptr;
+  }
+  block->next = head;
+  block->capacity = capacity;
+  block->used = 0;
+  head = block;
+  return block;
 }
 
-int _parseCommandLine(const char* cmd_line, char** args) {
-  FUNC_ENTRY()
-  int i = 0;
-  std::istringstream iss(_trim(string(cmd_line)).c_str());
-  for(std::string s; iss >> s; ) {
-    args[i] = (char*)malloc(s.length()+1);
-    memset(args[i], 0, s.length()+1);
-    strcpy(args[i], s.c_str());
-    args[++i] = NULL;
+void* Arena::allocate(size_t size, size_t align) {
+  if(head) {
+    char* base = (char*)(head + 1);
+    size_t start = (head->used + align - 1) & ~(align - 1);
+    if(start + size <= head->capacity) {
+      head->used = start + size;
+      return base + start;
+    }
   }
-  return i;
 
-  FUNC_EXIT()
+  // out of room (or first use): chain a block at least as large as the previous one
+  size_t capacity = head ? head->capacity * 2 : initial_capacity;
+  if(capacity < size + align) capacity = size + align;
+  if(newBlock(capacity) == nullptr) {
+    return nullptr;
+  }
+  return allocate(size, align);
 }
 
-bool _isBackgroundComamnd(const char* cmd_line) {
-  const string str(cmd_line);
-  return str[str.find_last_not_of(WHITESPACE)] == '&';
+bool _isWhitespace(char c) {
+  return c == ' ' || c == '\n' || c == '\r' || c == '\t' || c == '\f' || c == '\v';
 }
 
-bool _isComplexExternalCommand(const string cmd_line) {
-  const string specials = "?*";
-  return cmd_line.find_first_of(specials) != string::npos;
+bool _isOperatorChar(char c) {
+  return c == '|' || c == '>' || c == '<' || c == '&';
 }
 
-size_t _getFirstPipePos(const char* cmd_line) {
-  const string str(cmd_line);
-  const string reg_pipe = "|";
-  const string err_pipe = "|&";
-
-  return std::min(str.find(reg_pipe),str.find(err_pipe));
+// & is an operator only in &>, &>> and as the last character of the line
+// (like smash always read it); anywhere else it is part of a word: "a&b"
+bool _isWordAmpersand(const char* s, size_t i, size_t len) {
+  if(s[i] != '&' || (i + 1 < len && s[i + 1] == '>')) return false;
+  for(++i; i < len; ++i) {
+    if(!_isWhitespace(s[i])) return true;
+  }
+  return false;
 }
 
+// Unquoted words of a line of n bytes take at most n + 1 bytes (every word is
+// followed by a separator or the end of the line), and a whitespace separated
+// line has about n / 2 tokens and words. Sizing the first arena block like
+// this makes a command cost a single allocation; lines dense with operators
+// just chain a second block.
+size_t _lexArenaSize(size_t num_tokens, size_t text_bytes) {
+  return num_tokens * (sizeof(CommandLine::Token) + sizeof(char*)) + sizeof(char*) +
+         alignof(CommandLine::Token) + text_bytes;
+}
 
-size_t _getFirstRedirectionPos(const char* cmd_line) {
-  const string str(cmd_line);
-  const string reg_redirect = ">";
-  const string append_redirect = ">>";
+CommandLine::CommandLine(const char* cmd_line) :
+  raw(cmd_line),
+  arena(_lexArenaSize(raw.length() / 2 + 1, raw.length() + 1)),
+  tokens(nullptr),
+  num_tokens(0),
+  tokens_capacity(0),
+  num_words(0),
+  is_background(false),
+  has_glob(false),
+  needs_shell(false),
+  first_pipe(-1),
+  first_redirect(-1) {
+
+  size_t len = raw.length();
+  const char* s = raw.c_str();
+  char* out = (char*)arena.allocate(len + 1, 1);
+  if(out == nullptr) {
+    return;
+  }
+  tokens_capacity = len / 2 + 1;
+  if((tokens = (Token*)arena.allocate(tokens_capacity * sizeof(Token), alignof(Token))) == nullptr) {
+    tokens_capacity = 0;
+    return;
+  }
 
-  return std::min(str.find(reg_redirect),str.find(append_redirect));
-}
+  size_t i = 0;
+  while(i < len) {
+    if(_isWhitespace(s[i])) {
+      ++i;
+      continue;
+    }
 
-enum smash_cmd_type { SMASH_REGULAR_CMD, SMASH_PIPE_CMD, SMASH_REDIRECT_CMD };
+    Token* new_token = appendToken();
+    if(new_token == nullptr) {
+      break;
+    }
+    Token& token = *new_token;
+    token.begin = i;
+    token.text = nullptr;
+    token.io_fd = -1;
+    token.has_glob = false;
+    token.needs_shell = false;
+
+    // a number right before > or < is the fd redirected, as in "2>" or "0<"
+    size_t digits_end = i;
+    while(digits_end < len && digits_end - i < 4 && s[digits_end] >= '0' && s[digits_end] <= '9') ++digits_end;
+    if(digits_end > i && digits_end < len && (s[digits_end] == '>' || s[digits_end] == '<')) {
+      token.io_fd = atoi(s + i);
+      i = digits_end;
+    }
 
-smash_cmd_type _getCommandType(const char* cmd_line) {
-  size_t first_pipe_pos = _getFirstPipePos(cmd_line);
-  size_t first_redirect_pos = _getFirstRedirectionPos(cmd_line);
+    if(s[i] == '|') {
+      bool err_pipe = i + 1 < len && s[i + 1] == '&';
+      token.type = err_pipe ? SMASH_TOKEN_ERR_PIPE : SMASH_TOKEN_PIPE;
+      i += err_pipe ? 2 : 1;
+    } else if(s[i] == '>' || s[i] == '<') {
+      bool input = s[i++] == '<';
+      if(token.io_fd < 0) token.io_fd = input ? 0 : 1;
+      if(i < len && s[i] == '&') {
+        token.type = SMASH_TOKEN_DUP;
+        ++i;
+      } else if(!input && i < len && s[i] == '>') {
+        token.type = SMASH_TOKEN_APPEND;
+        ++i;
+      } else {
+        token.type = input ? SMASH_TOKEN_INPUT : SMASH_TOKEN_REDIRECT;
+      }
+    } else if(s[i] == '&' && i + 1 < len && s[i + 1] == '>') { // &> and &>> redirect stdout and stderr
+      bool append = i + 2 < len && s[i + 2] == '>';
+      token.type = append ? SMASH_TOKEN_APPEND : SMASH_TOKEN_REDIRECT;
+      token.io_fd = OUT_AND_ERR;
+      i += append ? 3 : 2;
+    } else if(s[i] == '&' && !_isWordAmpersand(s, i, len)) {
+      token.type = SMASH_TOKEN_BACKGROUND;
+      ++i;
+    } else { // word, runs until an unquoted whitespace or operator
+      token.type = SMASH_TOKEN_WORD;
+      token.text = out;
+      while(i < len && !_isWhitespace(s[i]) && (!_isOperatorChar(s[i]) || _isWordAmpersand(s, i, len))) {
+        char c = s[i];
+        if(c == '\\') { // escaped character is taken as is
+          if(i + 1 < len) *out++ = s[i + 1];
+          i += 2;
+        } else if(c == '\'') { // no escapes inside single quotes
+          for(++i; i < len && s[i] != '\''; ++i) *out++ = s[i];
+          ++i;
+        } else if(c == '"') { // only \" \\ \$ and \` are escapes inside double quotes
+          for(++i; i < len && s[i] != '"'; ++i) {
+            if(s[i] == '\\' && i + 1 < len && strchr("\"\\$`", s[i + 1])) ++i;
+            else if(s[i] == '$' || s[i] == '`') token.needs_shell = true;
+            *out++ = s[i];
+          }
+          ++i;
+        } else if(c == '{' && i + 1 < len && s[i + 1] == '}') { // "{}" is literal, as in bash
+          *out++ = '{';
+          *out++ = '}';
+          i += 2;
+        } else {
+          if(c == '*' || c == '?') token.has_glob = true;
+          if(strchr("$`;(){}", c) || (c == '~' && out == token.text)) token.needs_shell = true;
+          *out++ = c;
+          ++i;
+        }
+      }
+      if(i > len) i = len; // unterminated quote or trailing backslash
+      *out++ = '\0';
+    }
 
-  if(first_pipe_pos != string::npos && first_redirect_pos != string::npos) {
-    if(first_pipe_pos < first_redirect_pos) return SMASH_PIPE_CMD;
-    return SMASH_REDIRECT_CMD;
+    token.end = i;
   }
 
-  // reaching here means - either pipe or redirect or none
-  if(first_pipe_pos != string::npos) {
-    return SMASH_PIPE_CMD;
-  }
+  updateFlags();
+}
 
-  if(first_redirect_pos != string::npos) {
-    return SMASH_REDIRECT_CMD;
+// grows the token table by doubling, the old table is left behind in the arena
+CommandLine::Token* CommandLine::appendToken() {
+  if(num_tokens == tokens_capacity) {
+    int new_capacity = tokens_capacity * 2;
+    Token* new_tokens = (Token*)arena.allocate(new_capacity * sizeof(Token), alignof(Token));
+    if(new_tokens == nullptr) {
+      return nullptr;
+    }
+    memcpy(new_tokens, tokens, num_tokens * sizeof(Token));
+    tokens = new_tokens;
+    tokens_capacity = new_capacity;
   }
+  return &tokens[num_tokens++];
+}
 
-  return SMASH_REGULAR_CMD;
+size_t _wordBytes(const CommandLine& line, int first_token, int end_token) {
+  size_t text_bytes = 0;
+  for(int i = first_token; i < end_token; ++i) {
+    if(line.tokens[i].text) text_bytes += strlen(line.tokens[i].text) + 1;
+  }
+  return text_bytes;
 }
 
-void _removeBackgroundSign(char* cmd_line) {
-  const string str(cmd_line);
-  // find last character other than spaces
-  unsigned int idx = str.find_last_not_of(WHITESPACE);
-  // if all characters are spaces then return
-  if (idx == string::npos) {
+// Builds the line made of tokens [first_token, end_token) of parent without
+// lexing again: tokens are copied and rebased onto the sliced raw text.
+CommandLine::CommandLine(const CommandLine& parent, int first_token, int end_token) :
+  raw(parent.text(first_token, end_token)),
+  arena(first_token < end_token ?
+        _lexArenaSize(end_token - first_token, _wordBytes(parent, first_token, end_token)) : 0),
+  tokens(nullptr),
+  num_tokens(0),
+  tokens_capacity(0),
+  num_words(0),
+  is_background(false),
+  has_glob(false),
+  needs_shell(false),
+  first_pipe(-1),
+  first_redirect(-1) {
+
+  if(first_token >= end_token) {
     return;
   }
-  // if the command line does not end with & then return
-  if (cmd_line[idx] != '&') {
+
+  size_t text_bytes = _wordBytes(parent, first_token, end_token);
+  int count = end_token - first_token;
+  tokens = (Token*)arena.allocate(count * sizeof(Token), alignof(Token));
+  char* out = (char*)arena.allocate(text_bytes, 1);
+  if(tokens == nullptr || (text_bytes > 0 && out == nullptr)) {
+    tokens = nullptr;
     return;
   }
-  // replace the & (background sign) with space and then remove all tailing spaces.
-  cmd_line[idx] = ' ';
-  // truncate the command line string up to the last non-space character
-  cmd_line[str.find_last_not_of(WHITESPACE, idx) + 1] = 0;
+  tokens_capacity = count;
+
+  size_t base = parent.tokens[first_token].begin;
+  for(int i = first_token; i < end_token; ++i) {
+    Token& token = tokens[num_tokens++];
+    token = parent.tokens[i];
+    token.begin -= base;
+    token.end -= base;
+    if(token.text) {
+      size_t word_len = strlen(parent.tokens[i].text) + 1;
+      memcpy(out, parent.tokens[i].text, word_len);
+      token.text = out;
+      out += word_len;
+    }
+  }
+
+  updateFlags();
+}
+
+void CommandLine::updateFlags() {
+  for(int i = 0; i < num_tokens; ++i) {
+    switch(tokens[i].type) {
+      case SMASH_TOKEN_WORD:
+        ++num_words;
+        has_glob = has_glob || tokens[i].has_glob;
+        needs_shell = needs_shell || tokens[i].needs_shell;
+        break;
+      case SMASH_TOKEN_PIPE:
+      case SMASH_TOKEN_ERR_PIPE:
+        if(first_pipe < 0) first_pipe = i;
+        break;
+      case SMASH_TOKEN_REDIRECT:
+      case SMASH_TOKEN_APPEND:
+      case SMASH_TOKEN_INPUT:
+      case SMASH_TOKEN_DUP:
+        if(first_redirect < 0) first_redirect = i;
+        break;
+      case SMASH_TOKEN_BACKGROUND:
+        break;
+    }
+  }
+  is_background = num_tokens > 0 && tokens[num_tokens - 1].type == SMASH_TOKEN_BACKGROUND;
+}
+
+string CommandLine::text(int first_token, int end_token) const {
+  if(first_token >= end_token) return "";
+  size_t begin = tokens[first_token].begin;
+  return raw.substr(begin, tokens[end_token - 1].end - begin);
+}
+
+const char* CommandLine::firstWord() const {
+  if(num_tokens == 0 || tokens[0].type != SMASH_TOKEN_WORD) return "";
+  return tokens[0].text;
+}
+
+// wildcards are expanded by smash itself, bash is only needed for syntax
+// smash doesn't implement (variables, command substitution, lists, ...)
+bool _isComplexExternalCommand(const CommandLine& line) {
+  return line.needs_shell;
 }
 
 // TODO: Add your implementation for classes in Commands.h 
@@ -135,72 +348,179 @@ SmallShell::SmallShell() :
   curr_fg_pid(-1),
   curr_fg_cmd(""),
   curr_fg_jobid(-1),
-  forked_from_smash(false),
-  smash_pid(-1) {
-    
+  smash_pid(-1),
+  launch_mode(SMASH_LAUNCH_SPAWN),
+  signal_fd(-1),
+  epoll_fd(-1),
+  input_watched(-1),
+  got_sigchld(false),
+  notify_jobs(false),
+  last_status(0) {
+    memset(&this->fg_usage, 0, sizeof(this->fg_usage));
+    sigemptyset(&this->shell_signals);
+
     if((this->smash_pid = getpid()) < 0) {
       perror("smash error: getpid failed");
       return;
     }
+
+    // SMASH_LAUNCH=fork falls back to the classic fork()+execvp() launch path
+    const char* launch_env = getenv("SMASH_LAUNCH");
+    if(launch_env && strcmp(launch_env, "fork") == 0) {
+      this->launch_mode = SMASH_LAUNCH_FORK;
+    }
 }
 
 SmallShell::~SmallShell() {}
 
+// ======================== Built-in Registry ========================= //
+// Every built-in command, by name. Adding a built-in is one line here (plus
+// its class); the factory is generated from the class.
+#define SMASH_BUILTINS(X) \
+  X("pwd", GetCurrDirCommand) \
+  X("showpid", ShowPidCommand) \
+  X("cd", ChangeDirCommand) \
+  X("quit", QuitCommand) \
+  X("chprompt", CHPromptCommand) \
+  X("jobs", JobsCommand) \
+  X("fg", ForegroundCommand) \
+  X("bg", BackgroundCommand) \
+  X("kill", KillCommand) \
+  X("setcore", SetcoreCommand) \
+  X("getfiletype", GetFileTypeCommand) \
+  X("chmod", ChmodCommand) \
+  X("hash", HashCommand) \
+  X("timeout", TimeoutCommand) \
+  X("parallel", ParallelCommand) \
+  X("time", TimeCommand) \
+  X("smashstat", SmashStatCommand) \
+  X("history", HistoryCommand) \
+  X("cached", CachedCommand)
+
+typedef Command* (*builtin_factory_t)(CommandLine* line);
+
+template<class T>
+Command* _createBuiltIn(CommandLine* line) {
+  return new T(line);
+}
+
+template<>
+Command* _createBuiltIn<QuitCommand>(CommandLine* line) {
+  return new QuitCommand(line, &SmallShell::getInstance().jobs);
+}
+
+// FNV-1a, usable at compile time. The names are hashed into a table of
+// BUILTIN_TABLE_SIZE slots; the static_assert below proves at compile time
+// that no two built-ins share a slot, which makes the hash perfect: a lookup
+// is one hash of the first word, one slot and one strcmp.
+const uint32_t BUILTIN_HASH_SEED = 25;
+const uint32_t BUILTIN_TABLE_SIZE = 64;
+
+constexpr uint32_t _builtinHash(const char* name, uint32_t hash = BUILTIN_HASH_SEED) {
+  return *name ? _builtinHash(name + 1, (hash ^ (unsigned char)*name) * 16777619u) : hash;
+}
+
+constexpr uint32_t _builtinSlot(const char* name) {
+  return _builtinHash(name) & (BUILTIN_TABLE_SIZE - 1);
+}
+
+#define SMASH_BUILTIN_NAME(builtin_name, cls) builtin_name,
+constexpr const char* BUILTIN_NAMES[] = { SMASH_BUILTINS(SMASH_BUILTIN_NAME) };
+const int NUM_BUILTINS = sizeof(BUILTIN_NAMES) / sizeof(BUILTIN_NAMES[0]);
+
+// one recursion per built-in with the taken slots as a bit mask, so the
+// constexpr depth stays at NUM_BUILTINS (C++11 allows no loops here)
+constexpr bool _builtinSlotsUnique(int i, uint64_t used_slots) {
+  return i >= NUM_BUILTINS ? true :
+         (used_slots >> _builtinSlot(BUILTIN_NAMES[i]) & 1) ? false :
+         _builtinSlotsUnique(i + 1, used_slots | (uint64_t)1 << _builtinSlot(BUILTIN_NAMES[i]));
+}
+
+static_assert(BUILTIN_TABLE_SIZE <= 64, "the slot mask of _builtinSlotsUnique has 64 bits");
+static_assert(_builtinSlotsUnique(0, 0),
+              "built-in names collide in the dispatch table, change BUILTIN_HASH_SEED");
+
+struct BuiltinEntry {
+  const char* name;
+  builtin_factory_t factory;
+};
+
+const BuiltinEntry* _getBuiltinTable() {
+  static BuiltinEntry table[BUILTIN_TABLE_SIZE] = {};
+  static bool initialized = false;
+  if(!initialized) {
+#define SMASH_BUILTIN_ENTRY(builtin_name, cls) \
+    table[_builtinSlot(builtin_name)].name = builtin_name; \
+    table[_builtinSlot(builtin_name)].factory = _createBuiltIn<cls>;
+    SMASH_BUILTINS(SMASH_BUILTIN_ENTRY)
+    initialized = true;
+  }
+  return table;
+}
+
+// returns the factory of the built-in named word, or null if word is not a built-in
+builtin_factory_t _findBuiltin(const char* word) {
+  const BuiltinEntry& entry = _getBuiltinTable()[_builtinSlot(word)];
+  if(entry.name == nullptr || strcmp(entry.name, word) != 0) {
+    return nullptr;
+  }
+  return entry.factory;
+}
+
 /**
 * Creates and returns a pointer to Command class which matches the given command line (cmd_line)
 */
 Command * SmallShell::CreateCommand(const char* cmd_line) {
-  string cmd_s = _trim(string(cmd_line));
-  string first_word = cmd_s.substr(0, cmd_s.find_first_of("& \n"));
-  
-  smash_cmd_type cmd_type = _getCommandType(cmd_line);
-  if (cmd_type == SMASH_PIPE_CMD){
-    return new PipeCommand(cmd_line);
+  return CreateCommand(new CommandLine(cmd_line));
+}
+
+/**
+* Same as above for an already tokenized line, the created command takes ownership of line
+*/
+Command * SmallShell::CreateCommand(CommandLine* line) {
+  // like the bash keyword, time applies to the whole pipeline after it
+  if (line->num_tokens > 1 && strcmp(line->firstWord(), "time") == 0){
+    return new TimeCommand(line);
   }
 
-  if (cmd_type == SMASH_REDIRECT_CMD){
-    return new RedirectionCommand(cmd_line);
+  if (line->first_pipe >= 0){
+    return new PipeCommand(line);
+  }
+
+  if (line->first_redirect >= 0){
+    return new RedirectionCommand(line);
   }
 
   // regular command
-  if (first_word == "pwd") {
-    return new GetCurrDirCommand(cmd_line);
-  } else if (first_word == "showpid") {
-    return new ShowPidCommand(cmd_line);
-  } else if (first_word == "cd") {
-    return new ChangeDirCommand(cmd_line);
-  } else if(first_word == "quit") {
-    return new QuitCommand(cmd_line, nullptr); // TODO: add support for kill flag
-  } else if(first_word == "chprompt") {
-    return new CHPromptCommand(cmd_line);
-  } else if(first_word == "jobs") {
-    return new JobsCommand(cmd_line);
-  } else if(first_word == "fg") {
-    return new ForegroundCommand(cmd_line);
-  } else if(first_word == "bg") {
-    return new BackgroundCommand(cmd_line);
-  } else if(first_word == "kill") {
-    return new KillCommand(cmd_line);
-  } else if(first_word == "setcore") {
-    return new SetcoreCommand(cmd_line);
-  } else if(first_word == "getfiletype") {
-    return new GetFileTypeCommand(cmd_line);
-  } else if(first_word == "chmod") {
-    return new ChmodCommand(cmd_line);
+  builtin_factory_t factory = _findBuiltin(line->firstWord());
+  if (factory != nullptr) {
+    return factory(line);
   }
   
-  return new ExternalCommand(cmd_line);
+  return new ExternalCommand(line);
 }
 
 void SmallShell::executeCommand(const char *cmd_line) {
-  string str(cmd_line);
-  if(_trim(str).empty()) return;
-  Command* cmd = CreateCommand(cmd_line);
+  waitEvents(-1, 0); // signals that came while the line was read (batch mode never blocks for input)
+  TraceSpan command_span(profiler, SMASH_PHASE_COMMAND);
+  TraceSpan parse_span(profiler, SMASH_PHASE_PARSE);
+  CommandLine* line = new CommandLine(cmd_line);
+  parse_span.end();
+  if(line->num_words == 0) {
+    delete line;
+    return;
+  }
+  TraceSpan create_span(profiler, SMASH_PHASE_CREATE);
+  Command* cmd = CreateCommand(line);
+  create_span.end();
 
+  last_status = 0; // built-ins succeed, external commands report their own status
+  TraceSpan reap_span(profiler, SMASH_PHASE_REAP);
   jobs.removeFinishedJobs();
+  reap_span.end();
   cmd->execute();
   delete cmd;
-  if(forked_from_smash) exit(0);
+  reaped_children.clear();
 }
 
 string SmallShell::getPromptMessage() const {
@@ -211,312 +531,802 @@ void SmallShell::setPromptMessage(string new_prompt) {
   this->prompt = new_prompt;
 }
 
-// ========================== Commands =========================== //
+// shell style exit status: the exit code, or 128 + signal number
+int _exitStatus(int status) {
+  if(WIFEXITED(status)) return WEXITSTATUS(status);
+  if(WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+  if(WIFSTOPPED(status)) return 128 + WSTOPSIG(status);
+  return 0;
+}
 
-// ============= Command ================ //
-Command::Command(const char* cmd_line) : cmd(cmd_line) {
-  this->argc = _parseCommandLine(cmd_line, this->argv);
+// adds usage to total: times and counters are summed, maxrss is the peak
+void _addUsage(struct rusage* total, const struct rusage& usage) {
+  timeradd(&total->ru_utime, &usage.ru_utime, &total->ru_utime);
+  timeradd(&total->ru_stime, &usage.ru_stime, &total->ru_stime);
+  total->ru_maxrss = max(total->ru_maxrss, usage.ru_maxrss);
+  total->ru_minflt += usage.ru_minflt;
+  total->ru_majflt += usage.ru_majflt;
+  total->ru_nvcsw += usage.ru_nvcsw;
+  total->ru_nivcsw += usage.ru_nivcsw;
 }
 
-Command::~Command() {
-  for(int i = 0 ;i < argc; ++i){
-    if(argv[i]) free(argv[i]);
+// ========================== Line Reader =========================== //
+LineReader::LineReader(int fd) :
+  fd(fd),
+  data(nullptr),
+  capacity(0),
+  begin(0),
+  end(0),
+  is_mapped(false),
+  eof(false) {
+
+  struct stat file_stat;
+  if(fstat(fd, &file_stat) == 0 && S_ISREG(file_stat.st_mode) && file_stat.st_size > 0) {
+    off_t offset = lseek(fd, 0, SEEK_CUR);
+    void* mapped = mmap(nullptr, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(mapped != MAP_FAILED) {
+      madvise(mapped, file_stat.st_size, MADV_SEQUENTIAL);
+      data = (char*)mapped;
+      capacity = end = file_stat.st_size;
+      begin = offset > 0 ? offset : 0;
+      is_mapped = true;
+      eof = true; // everything is already available
+      return;
+    }
+  }
+
+  capacity = CHUNK_SIZE;
+  if((data = (char*)malloc(capacity)) == nullptr) {
+    perror("smash error: malloc failed");
+    capacity = 0;
+    eof = true;
   }
 }
 
-// ============================ Redirection Command ============================= //
-RedirectionCommand::RedirectionCommand(const char* cmd_line) : Command(cmd_line) {
-  string str(cmd_line);
-  string delimiter;
-  size_t reg_redirect_pos = str.find(">");
-  size_t append_redirect_pos = str.find(">>");
-  size_t split_pos;
-
-  if(reg_redirect_pos != string::npos && append_redirect_pos != string::npos){
-    // both substrings are in str
-    if(reg_redirect_pos < append_redirect_pos) {
-      // ">" is first
-      this->type = SMASH_REG_REDIRECT;
-      split_pos = reg_redirect_pos;
-      delimiter = ">";
-    } else {
-      // ">>" is first
-      this->type = SMASH_APPEND_REDIRECT;
-      split_pos = append_redirect_pos;
-      delimiter = ">>";
-    }
-  } else { // at least one of them is missing
-    if(reg_redirect_pos != string::npos) {
-      // ">" is in string and ">>" is not
-      this->type = SMASH_REG_REDIRECT;
-      split_pos = reg_redirect_pos;
-      delimiter = ">";
+LineReader::~LineReader() {
+  if(is_mapped) munmap(data, capacity);
+  else free(data);
+}
 
-    } else if(append_redirect_pos != string::npos) {
-      // ">>" is in string and ">" is not
-      this->type = SMASH_APPEND_REDIRECT;
-      split_pos = append_redirect_pos;
-      delimiter = ">>";
+/**
+* Reads one chunk of input. Returns the number of bytes read, 0 at EOF and
+* -1 on error (errno set, e.g. EAGAIN or EINTR).
+*/
+ssize_t LineReader::fill() {
+  if(eof) return 0;
+
+  // move the unconsumed tail to the front, grow if a line is longer than the buffer
+  if(begin > 0) {
+    memmove(data, data + begin, end - begin);
+    end -= begin;
+    begin = 0;
+  }
+  if(end == capacity) {
+    char* bigger = (char*)realloc(data, capacity * 2);
+    if(bigger == nullptr) {
+      perror("smash error: realloc failed");
+      return -1;
     }
+    data = bigger;
+    capacity *= 2;
   }
 
-  this->redirect_cmd = str.substr(0, split_pos);
-  this->file_path = _trim(str.substr(split_pos + delimiter.length()));
+  ssize_t bytes_read = read(fd, data + end, capacity - end);
+  if(bytes_read == 0) eof = true;
+  if(bytes_read > 0) end += bytes_read;
+  return bytes_read;
 }
 
-void RedirectionCommand::execute() {
-  pid_t f_pid = fork();
-  if(f_pid < 0) {
-    perror("smash error: fork failed");
-    return;
+/**
+* Extracts the next complete line (without its newline) if one is buffered.
+* At EOF a last line without a newline is returned as well.
+*/
+bool LineReader::nextLine(string& line) {
+  if(is_mapped && fd == STDIN_FILENO) {
+    // a command may have read (part of) stdin since syncOffset()
+    off_t offset = lseek(fd, 0, SEEK_CUR);
+    if(offset >= (off_t)begin && offset <= (off_t)end) begin = offset;
   }
+  if(begin >= end) return false;
+  const char* line_start = data + begin;
+  const char* newline = (const char*)memchr(line_start, '\n', end - begin);
+  if(newline == nullptr) {
+    if(!eof) return false;
+    line.assign(line_start, end - begin);
+    begin = end;
+    return true;
+  }
+  line.assign(line_start, newline - line_start);
+  begin += newline - line_start + 1;
+  return true;
+}
 
-  if(f_pid == 0){ // child
-    SmallShell& smash = SmallShell::getInstance();
-    smash.forked_from_smash = true;
-    if(close(1) < 0) {
-      perror("smash error: close failed");
-      return;
+bool LineReader::readLine(string& line) {
+  while(!nextLine(line)) {
+    if(eof) return false;
+    if(fill() < 0 && errno != EINTR) {
+      perror("smash error: read failed");
+      return false;
     }
+  }
+  return true;
+}
 
-    int r_file_flags;
-    mode_t r_file_mode = 0655;
-
-    if(this->type == SMASH_REG_REDIRECT)
-      r_file_flags = O_WRONLY | O_CREAT | O_TRUNC;
-    else
-      r_file_flags = O_WRONLY | O_CREAT | O_APPEND;
-    
+bool LineReader::atEof() const {
+  return eof && begin >= end;
+}
 
-    if(open(file_path.c_str(), r_file_flags, r_file_mode) < 0) {
-      perror("smash error: open failed");
-      return;
-    }
-    smash.executeCommand(this->redirect_cmd.c_str());
-  } else {
-    if(waitpid(f_pid, nullptr, 0) < 0){
-      perror("smash error: waitpid failed");
-      return;
+// Commands started by smash share its stdin. When that is a seekable file,
+// move the file offset to the first byte smash hasn't consumed yet, so a
+// command reading stdin continues right after its own line.
+void LineReader::syncOffset() {
+  if(fd != STDIN_FILENO) return;
+  if(is_mapped) {
+    lseek(fd, begin, SEEK_SET);
+  } else if(end > begin) {
+    if(lseek(fd, -(off_t)(end - begin), SEEK_CUR) >= 0) {
+      end = begin; // the kernel will hand these bytes out again
     }
   }
 }
 
-// ============================ Pipe Command ============================= //
-PipeCommand::PipeCommand(const char* cmd_line) : Command(cmd_line) {
-  string str(cmd_line);
-  string delimiter;
-  size_t reg_pipe_pos = str.find("|");
-  size_t err_pipe_pos = str.find("|&");
-  size_t split_pos;
-
-  if(reg_pipe_pos != string::npos && err_pipe_pos != string::npos){
-    // both substrings are in str
-    if(reg_pipe_pos < err_pipe_pos) {
-      // "|" is first
-      this->type = SMASH_REG_PIPE;
-      split_pos = reg_pipe_pos;
-      delimiter = "|";
-    } else {
-      // "|&" is first
-      this->type = SMASH_ERR_PIPE;
-      split_pos = err_pipe_pos;
-      delimiter = "|&";
-    }
-  } else { // at least one of them is missing
-    if(reg_pipe_pos != string::npos) {
-      // "|" is in string and "|&" is not
-      this->type = SMASH_REG_PIPE;
-      split_pos = reg_pipe_pos;
-      delimiter = "|";
+// ========================== Commands =========================== //
 
-    } else if(err_pipe_pos != string::npos) {
-      // "|&" is in string and "|" is not
-      this->type = SMASH_ERR_PIPE;
-      split_pos = err_pipe_pos;
-      delimiter = "|&";
+// ============= Command ================ //
+Command::Command(CommandLine* line) : cmd(line->raw), argv(nullptr), argc(0), line(line) {
+  // argv lives in the same arena as the words it points to, so any number of
+  // arguments costs no allocation beyond the arena itself
+  this->argv = (char**)line->arena.allocate((line->num_words + 1) * sizeof(char*), alignof(char*));
+  if(this->argv == nullptr) {
+    static char* empty_argv[] = {nullptr};
+    this->argv = empty_argv;
+    return;
+  }
+  for(int i = 0; i < line->num_tokens; ++i) {
+    if(line->tokens[i].type == SMASH_TOKEN_WORD) {
+      argv[argc++] = line->tokens[i].text;
     }
   }
+  argv[argc] = nullptr;
+}
 
-  this->pipe_cmd_1 = str.substr(0, split_pos);
-  this->pipe_cmd_2 = str.substr(split_pos + delimiter.length());
+Command::~Command() {
+  delete line;
 }
 
-void PipeCommand::execute() {
-  int pipe_fd[2];
-  SmallShell& smash = SmallShell::getInstance();
-  if(pipe(pipe_fd) < 0) {
-    perror("smash error: pipe failed");
-    return;
-  }
-  pid_t f_pid;
-  f_pid = fork();
+// appends c to a glob(3) pattern so that it only matches itself
+void _appendQuoted(string* pattern, char c) {
+  if(strchr("*?[]\\", c) != nullptr) *pattern += '\\';
+  *pattern += c;
+}
 
-  if(f_pid < 0) {
-    perror("smash error: fork failed");
-    return;
+// The glob(3) pattern of the word in raw[begin, end): the word unquoted like
+// the lexer does it, but with its quoted and escaped wildcards escaped, so
+// only the unquoted ones expand ("*"* matches the names starting with *).
+string _globPattern(const string& raw, size_t begin, size_t end) {
+  string pattern;
+  for(size_t i = begin; i < end; ) {
+    char c = raw[i];
+    if(c == '\\') {
+      if(i + 1 < end) _appendQuoted(&pattern, raw[i + 1]);
+      i += 2;
+    } else if(c == '\'') {
+      for(++i; i < end && raw[i] != '\''; ++i) _appendQuoted(&pattern, raw[i]);
+      ++i;
+    } else if(c == '"') {
+      for(++i; i < end && raw[i] != '"'; ++i) {
+        if(raw[i] == '\\' && i + 1 < end && strchr("\"\\$`", raw[i + 1])) ++i;
+        _appendQuoted(&pattern, raw[i]);
+      }
+      ++i;
+    } else {
+      pattern += c;
+      ++i;
+    }
   }
+  return pattern;
+}
 
-  if(f_pid == 0){ // child
-    smash.forked_from_smash = true;
+// Replaces every word with unquoted wildcards by the sorted list of matching
+// paths (or by itself when nothing matches, like bash), using glob(3) in
+// process. The new argv and the matched names live in the arena of the line.
+void Command::expandGlobs() {
+  if(!line->has_glob || line->needs_shell) return;
+
+  vector<glob_t> results;
+  int new_argc = 0;
+  for(int i = 0; i < line->num_tokens; ++i) {
+    const CommandLine::Token& token = line->tokens[i];
+    if(token.type != SMASH_TOKEN_WORD) continue;
+    if(!token.has_glob) {
+      ++new_argc;
+      continue;
+    }
+    glob_t result;
+    int err = glob(_globPattern(line->raw, token.begin, token.end).c_str(), 0, nullptr, &result);
+    if(err != 0) { // no match (or an error) keeps the word as is
+      if(err != GLOB_NOMATCH) perror("smash error: glob failed");
+      globfree(&result);
+      result.gl_pathc = 0;
+      result.gl_pathv = nullptr;
+    }
+    results.push_back(result);
+    new_argc += result.gl_pathv ? result.gl_pathc : 1;
+  }
 
-    int redirect_to = this->type == SMASH_REG_PIPE ? 1 : 2;
-    if(dup2(pipe_fd[1], redirect_to) < 0) {
-      perror("smash error: dup2 failed");
-      
-      if(close(pipe_fd[0]) < 0) {
-        perror("smash error: close failed");
-        delete this;
-        exit(0);
+  char** new_argv = (char**)line->arena.allocate((new_argc + 1) * sizeof(char*), alignof(char*));
+  if(new_argv != nullptr) {
+    int result_idx = 0;
+    argc = 0;
+    for(int i = 0; i < line->num_tokens; ++i) {
+      const CommandLine::Token& token = line->tokens[i];
+      if(token.type != SMASH_TOKEN_WORD) continue;
+      if(!token.has_glob) {
+        new_argv[argc++] = token.text;
+        continue;
       }
-      if(close(pipe_fd[1]) < 0) {
-        perror("smash error: close failed");
-        delete this;
-        exit(0);
+      const glob_t& result = results[result_idx++];
+      if(result.gl_pathv == nullptr) {
+        new_argv[argc++] = token.text;
+        continue;
+      }
+      for(size_t j = 0; j < result.gl_pathc; ++j) {
+        size_t path_len = strlen(result.gl_pathv[j]) + 1;
+        char* path = (char*)line->arena.allocate(path_len, 1);
+        if(path == nullptr) continue;
+        memcpy(path, result.gl_pathv[j], path_len);
+        new_argv[argc++] = path;
       }
-      
-      return;
-    }
-    if(close(pipe_fd[0]) < 0) {
-      perror("smash error: close failed");
-      delete this;
-      exit(0);
     }
-    if(close(pipe_fd[1]) < 0) {
-      perror("smash error: close failed");
-      delete this;
-      exit(0);
+    new_argv[argc] = nullptr;
+    argv = new_argv;
+  }
+
+  for(auto it = results.begin(); it != results.end(); ++it) {
+    if(it->gl_pathv != nullptr) globfree(&*it);
+  }
+}
+
+// ============================ Redirection Command ============================= //
+bool _isRedirection(token_t type) {
+  return type == SMASH_TOKEN_REDIRECT || type == SMASH_TOKEN_APPEND ||
+         type == SMASH_TOKEN_INPUT || type == SMASH_TOKEN_DUP;
+}
+
+// Every redirection takes the word after it, the other words (before,
+// between or after the redirections, as in "echo > f hi") are the command.
+// Only a final & may follow.
+RedirectionCommand::RedirectionCommand(CommandLine* line) : Command(line), command(nullptr), is_valid(true) {
+  int end_token = line->is_background ? line->num_tokens - 1 : line->num_tokens;
+  string command_text; // raw text of the command words, quotes included
+  bool words_after = false;
+  for(int i = 0; i < end_token; ++i) {
+    if(line->tokens[i].type == SMASH_TOKEN_WORD) {
+      words_after = words_after || i > line->first_redirect;
+      if(!command_text.empty()) command_text += ' ';
+      command_text += line->text(i, i + 1);
+      continue;
     }
-    smash.executeCommand(this->pipe_cmd_1.c_str());
-  } else { // parent
-    if(waitpid(f_pid, nullptr, 0) < 0) {
-      perror("smash error: waitpid failed");
-      return;
+    if(!_isRedirection(line->tokens[i].type) || i + 1 >= end_token ||
+       line->tokens[i + 1].type != SMASH_TOKEN_WORD) {
+      is_valid = false;
+      break;
     }
+    Redirect redirect = {line->tokens[i].type, line->tokens[i].io_fd, line->tokens[i + 1].text};
+    redirects.push_back(redirect);
+    ++i;
   }
 
-  f_pid = fork();
+  // the common "cmd args > file" shares the tokens of the line, words after a redirection are lexed again
+  CommandLine* command_line = words_after ? new CommandLine(command_text.c_str())
+                                          : new CommandLine(*line, 0, line->first_redirect);
+  command = SmallShell::getInstance().CreateCommand(command_line);
+  ExternalCommand* external_cmd = dynamic_cast<ExternalCommand*>(command);
+  if(external_cmd != nullptr && line->needs_shell) {
+    // bash runs the whole line ("cmd > f ; cat f"), so it also gets the
+    // redirections, where the user put them, instead of smash applying
+    // them to the whole list
+    delete command;
+    external_cmd = new ExternalCommand(new CommandLine(*line, 0, end_token));
+    command = external_cmd;
+    redirects.clear();
+    is_valid = true;
+  }
+  if(external_cmd != nullptr) { // "cmd > file &" is a job, listed with its redirections
+    external_cmd->is_background = line->is_background;
+    external_cmd->cmd = cmd;
+  }
+}
 
-  if(f_pid < 0) {
-    perror("smash error: fork failed");
-    return;
+RedirectionCommand::~RedirectionCommand() {
+  cleanup();
+  delete command;
+}
+
+// moves fd out of 0-9, the fds a redirection may name, like bash does;
+// every fd smash keeps open while a command runs lives at 10 and up
+int _moveAboveUserFds(int fd) {
+  if(fd < 0 || fd >= 10) return fd;
+  int moved_fd = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+  if(moved_fd < 0) {
+    perror("smash error: fcntl failed");
+    return fd;
   }
-  
-  if(f_pid == 0){ // child
-    smash.forked_from_smash = true;
+  close(fd);
+  return moved_fd;
+}
 
-    if(dup2(pipe_fd[0], 0) < 0) {
-      perror("smash error: dup2 failed");
-      
-      if(close(pipe_fd[0]) < 0) {
-        perror("smash error: close failed");
-        delete this;
-        exit(0);
-      }
-      if(close(pipe_fd[1]) < 0) {
-        perror("smash error: close failed");
-        delete this;
-        exit(0);
-      }
-      return;
+/**
+* Opens the files of the redirections and turns them into fd actions, kept
+* in the order they were written: "> f 2>&1" sends both stdout and stderr
+* to f, "2>&1 > f" only stdout. Prints the error and returns false if a
+* redirection is invalid or its file can't be opened.
+*/
+bool RedirectionCommand::prepare() {
+  if(!is_valid) {
+    cerr << "smash error: redirection: invalid arguments\n";
+    return false;
+  }
+  for(auto it = redirects.begin(); it != redirects.end(); ++it) {
+    // fds from 10 up are smash's own (signalfd, epoll, timerfd, history, ...)
+    if(it->fd >= 10) {
+      cerr << "smash error: redirection: invalid arguments\n";
+      cleanup();
+      return false;
     }
-    if(close(pipe_fd[0]) < 0) {
-      perror("smash error: close failed");
-      delete this;
-      exit(0);
+    if(it->type == SMASH_TOKEN_DUP) { // n>&m, n<&m, n>&-
+      const char* target = it->target.c_str();
+      if(strcmp(target, "-") == 0) {
+        fd_actions.push_back(LaunchSpec::closeAction(it->fd));
+      } else if(strlen(target) == 1 && target[0] >= '0' && target[0] <= '9') {
+        fd_actions.push_back(LaunchSpec::dupAction(atoi(target), it->fd));
+      } else {
+        cerr << "smash error: redirection: invalid arguments\n";
+        cleanup();
+        return false;
+      }
+      continue;
     }
-    if(close(pipe_fd[1]) < 0) {
-      perror("smash error: close failed");
-      delete this;
-      exit(0);
+
+    int flags = O_RDONLY;
+    if(it->type == SMASH_TOKEN_REDIRECT) flags = O_WRONLY | O_CREAT | O_TRUNC;
+    if(it->type == SMASH_TOKEN_APPEND) flags = O_WRONLY | O_CREAT | O_APPEND;
+    int file_fd = open(it->target.c_str(), flags | O_CLOEXEC, 0666);
+    if(file_fd < 0) {
+      perror("smash error: open failed");
+      cleanup();
+      return false;
     }
-    smash.executeCommand(this->pipe_cmd_2.c_str());
-  } else { // parent
-    if(close(pipe_fd[0]) < 0) {
-      perror("smash error: close failed");
-      return;
+    file_fd = _moveAboveUserFds(file_fd);
+    opened_fds.push_back(file_fd);
+    if(it->fd == CommandLine::OUT_AND_ERR) {
+      fd_actions.push_back(LaunchSpec::dupAction(file_fd, 1));
+      fd_actions.push_back(LaunchSpec::dupAction(file_fd, 2));
+    } else {
+      fd_actions.push_back(LaunchSpec::dupAction(file_fd, it->fd));
     }
-    if(close(pipe_fd[1]) < 0) {
+  }
+  return true;
+}
+
+// closes the files opened by prepare()
+void RedirectionCommand::cleanup() {
+  for(auto it = opened_fds.begin(); it != opened_fds.end(); ++it) {
+    if(close(*it) < 0) {
       perror("smash error: close failed");
-      return;
-    }
-    if(waitpid(f_pid, nullptr, 0) < 0) {
-      perror("smash error: waitpid failed");
-      return;
     }
   }
+  opened_fds.clear();
+  fd_actions.clear();
 }
 
+/**
+* Applies fd_actions to smash itself, for a built-in. Every fd changed is
+* first saved (-1 if it was closed) in saved_fds, for _restoreFds.
+*/
+bool _redirectInProcess(const vector<LaunchSpec::FdAction>& fd_actions, vector<pair<int, int>>* saved_fds) {
+  for(auto it = fd_actions.begin(); it != fd_actions.end(); ++it) {
+    bool saved = false;
+    for(auto saved_it = saved_fds->begin(); saved_it != saved_fds->end(); ++saved_it) {
+      saved = saved || saved_it->first == it->fd;
+    }
+    if(!saved) {
+      int saved_fd = fcntl(it->fd, F_DUPFD_CLOEXEC, 10);
+      if(saved_fd < 0 && errno != EBADF) {
+        perror("smash error: fcntl failed");
+        return false;
+      }
+      saved_fds->push_back(make_pair(it->fd, saved_fd));
+    }
 
-// ============= Built in Command ============ //
-BuiltInCommand::BuiltInCommand(const char* cmd_line) : Command(cmd_line) {
-  for(int i = 0 ;i < argc; ++i){
-    if(argv[i]) free(argv[i]);
+    if(it->type == LaunchSpec::SMASH_FD_CLOSE) {
+      close(it->fd);
+    } else if(dup2(it->src_fd, it->fd) < 0) {
+      perror("smash error: dup2 failed");
+      return false;
+    }
   }
-  char no_bg_cmd[COMMAND_ARGS_MAX_LENGTH];
-  strcpy(no_bg_cmd, cmd_line);
-  _removeBackgroundSign(no_bg_cmd);
-  this->argc = _parseCommandLine(no_bg_cmd, this->argv);
+  return true;
 }
 
-// ============= GCWD Command ============== //
-GetCurrDirCommand::GetCurrDirCommand(const char* cmd_line) : BuiltInCommand(cmd_line) {
+void _restoreFds(const vector<pair<int, int>>& saved_fds) {
+  for(auto it = saved_fds.rbegin(); it != saved_fds.rend(); ++it) {
+    if(it->second < 0) {
+      close(it->first);
+      continue;
+    }
+    if(dup2(it->second, it->first) < 0) {
+      perror("smash error: dup2 failed");
+    }
+    close(it->second);
+  }
 }
 
-void GetCurrDirCommand::execute() {
-  const int MAX_PATH = 200;
-
-  char path[MAX_PATH];
-
-  if(!getcwd(path, MAX_PATH)) {
-    perror("smash error: getcwd failed");
+void RedirectionCommand::execute() {
+  SmallShell& smash = SmallShell::getInstance();
+  if(!prepare()) {
+    smash.last_status = 1;
     return;
   }
 
-  cout << path << "\n";
+  ExternalCommand* external_cmd = dynamic_cast<ExternalCommand*>(command);
+  if(external_cmd != nullptr) {
+    external_cmd->redirect_actions = fd_actions;
+    external_cmd->execute();
+  } else {
+    vector<pair<int, int>> saved_fds;
+    cout.flush(); // what smash printed so far still goes to the old stdout
+    if(_redirectInProcess(fd_actions, &saved_fds)) {
+      command->execute();
+    } else {
+      smash.last_status = 1;
+    }
+    cout.flush();
+    _restoreFds(saved_fds);
+    // a closed or full target leaves the streams failed, which would silence every later built-in
+    cout.clear();
+    cerr.clear();
+  }
+  cleanup();
 }
 
+// ============================ Pipe Command ============================= //
+PipeCommand::PipeCommand(CommandLine* line) : Command(line) {
+  int stage_start = 0;
+
+  // split "a | b |& c | d" into stages, each remembering the kind of pipe it writes to
+  for(int i = line->first_pipe; i < line->num_tokens; ++i) {
+    token_t token_type = line->tokens[i].type;
+    if(token_type != SMASH_TOKEN_PIPE && token_type != SMASH_TOKEN_ERR_PIPE) continue;
+
+    Stage stage;
+    stage.first_token = stage_start;
+    stage.end_token = i;
+    stage.type = token_type == SMASH_TOKEN_ERR_PIPE ? SMASH_ERR_PIPE : SMASH_REG_PIPE;
+    this->stages.push_back(stage);
+    stage_start = i + 1;
+  }
 
-// ============= chprompt Comamand ============ //
-CHPromptCommand::CHPromptCommand(const char* cmd_line) : BuiltInCommand(cmd_line) {
+  Stage last_stage;
+  last_stage.first_token = stage_start;
+  last_stage.end_token = line->num_tokens;
+  last_stage.type = SMASH_REG_PIPE; // last stage writes to smash's stdout
+  this->stages.push_back(last_stage);
 }
 
-void CHPromptCommand::execute() {
-  SmallShell& shell = SmallShell::getInstance();
-  if(argc == 1) { // no args
-    shell.setPromptMessage("smash");
-  } else { // 2 or more args
-    shell.setPromptMessage(argv[1]);
+void _closePipes(const vector<int>& pipe_fds) {
+  for(auto it = pipe_fds.begin(); it != pipe_fds.end(); ++it) {
+    if(*it >= 0 && close(*it) < 0) {
+      perror("smash error: close failed");
+    }
   }
 }
 
-// ============= showPID Command ============== //
-ShowPidCommand::ShowPidCommand(const char* cmd_line) : BuiltInCommand(cmd_line) {
+// the external command of a stage (maybe with redirections), null for a built-in
+ExternalCommand* _stageExternal(Command* stage_cmd) {
+  RedirectionCommand* redirect_cmd = dynamic_cast<RedirectionCommand*>(stage_cmd);
+  return dynamic_cast<ExternalCommand*>(redirect_cmd ? redirect_cmd->command : stage_cmd);
 }
 
-void ShowPidCommand::execute() {
+// true for a built-in that changes smash itself (cwd, prompt, jobs, or
+// leaving it), which a pipeline stage must not do
+bool _changesShellState(Command* stage_cmd) {
+  RedirectionCommand* redirect_cmd = dynamic_cast<RedirectionCommand*>(stage_cmd);
+  Command* command = redirect_cmd ? redirect_cmd->command : stage_cmd;
+  return dynamic_cast<ChangeDirCommand*>(command) || dynamic_cast<CHPromptCommand*>(command) ||
+         dynamic_cast<ForegroundCommand*>(command) || dynamic_cast<BackgroundCommand*>(command) ||
+         dynamic_cast<QuitCommand*>(command) || dynamic_cast<KillCommand*>(command);
+}
+
+// Runs such a built-in in a forked copy of smash, the way bash runs every
+// stage in a subshell: "cd dir | cat" leaves smash's cwd alone. The copy
+// has no jobs, so fg, bg and kill there act on nothing, like bash's
+// "no job control" in a subshell, and quit only ends the copy.
+pid_t _forkBuiltin(Command* stage_cmd, pid_t pgid, int in_fd, int out_fd, int redirect_to, const vector<int>& pipe_fds) {
+  cout.flush();
+  pid_t pid = fork();
+  if(pid < 0) {
+    perror("smash error: fork failed");
+    return -1;
+  }
+  if(pid > 0) return pid;
+
+  // child process, set up like _forkProcess and left with _exit as well
   SmallShell& smash = SmallShell::getInstance();
-  cout << "smash pid is " << smash.smash_pid << "\n";
+  sigset_t empty_mask;
+  sigemptyset(&empty_mask);
+  if(sigprocmask(SIG_SETMASK, &empty_mask, nullptr) < 0) {
+    perror("smash error: sigprocmask failed");
+    _exit(1);
+  }
+  if(setpgid(0, pgid) < 0) {
+    perror("smash error: setpgrp failed");
+    _exit(1);
+  }
+  if((in_fd >= 0 && dup2(in_fd, 0) < 0) || (out_fd >= 0 && dup2(out_fd, redirect_to) < 0)) {
+    perror("smash error: dup2 failed");
+    _exit(1);
+  }
+  _closePipes(pipe_fds); // nothing is exec'ed, O_CLOEXEC would not close them
+  while(!smash.jobs.empty()) {
+    smash.jobs.removeJobById(smash.jobs.first_job->job_id);
+  }
+  smash.last_status = 0;
+  RedirectionCommand* redirect_cmd = dynamic_cast<RedirectionCommand*>(stage_cmd);
+  if(dynamic_cast<QuitCommand*>(redirect_cmd ? redirect_cmd->command : stage_cmd) == nullptr) {
+    stage_cmd->execute(); // quit would exit() and run smash's atexit handlers here, leaving is all it does
+  }
+  cout.flush();
+  _exit(smash.last_status);
 }
 
-// ============= CD Command ============== //
-ChangeDirCommand::ChangeDirCommand(const char* cmd_line) :
-  BuiltInCommand(cmd_line) {}
+// writer thread: feeds the captured output of a built-in stage to the next stage
+void _pumpOutput(int output_fd, int pipe_fd) {
+  DataPump::pump(output_fd, pipe_fd);
+  close(output_fd);
+  close(pipe_fd);
+}
 
-void ChangeDirCommand::execute() {
-  if(argc > 2){
-    cerr << "smash error: cd: too many arguments\n";
-    return;
+// All stages are started before any of them is waited for, so they run
+// concurrently in one process group and stream through the pipes. Built-in
+// stages run inside smash once the external ones are spawned, with smash's
+// fds switched to their pipes, so "jobs | grep Stopped" costs one process.
+// A built-in that has another built-in after it writes into a memfd
+// instead: smash must not block on a pipe that only drains once that later
+// built-in has run. The memfd is the next stage's stdin if that is a
+// built-in too, otherwise a writer thread feeds it into the pipe.
+void PipeCommand::execute() {
+  SmallShell& smash = SmallShell::getInstance();
+  int num_stages = stages.size();
+
+  // pipe_fds[2*i] is the read end and pipe_fds[2*i+1] the write end of the pipe after stage i
+  vector<int> pipe_fds;
+  for(int i = 0; i < num_stages - 1; ++i) {
+    int pipe_fd[2];
+    if(pipe2(pipe_fd, O_CLOEXEC) < 0) {
+      perror("smash error: pipe failed");
+      _closePipes(pipe_fds);
+      return;
+    }
+    pipe_fds.push_back(_moveAboveUserFds(pipe_fd[0]));
+    pipe_fds.push_back(_moveAboveUserFds(pipe_fd[1]));
   }
 
-  // if no arguments, do nothing
-  if(argc == 1) {
-    return;
+  vector<Command*> stage_cmds;
+  vector<bool> is_builtin; // runs inside smash
+  vector<bool> is_forked; // a built-in run by _forkBuiltin, spawned with the external stages
+  int last_builtin = -1;
+  for(int i = 0; i < num_stages; ++i) {
+    stage_cmds.push_back(smash.CreateCommand(new CommandLine(*line, stages[i].first_token, stages[i].end_token)));
+    is_forked.push_back(_changesShellState(stage_cmds[i]));
+    is_builtin.push_back(_stageExternal(stage_cmds[i]) == nullptr && !is_forked[i]);
+    if(is_builtin[i]) last_builtin = i;
   }
 
-  const int MAX_PATH = 200;
-  char curr_path[MAX_PATH];
+  vector<pid_t> stage_pids;
+  pid_t pgid = 0;
+  for(int i = 0; i < num_stages; ++i) {
+    if(is_builtin[i]) continue;
+    int in_fd = i > 0 ? pipe_fds[2 * (i - 1)] : -1;
+    int out_fd = i < num_stages - 1 ? pipe_fds[2 * i + 1] : -1;
+    int redirect_to = stages[i].type == SMASH_REG_PIPE ? 1 : 2;
+    if(is_forked[i]) {
+      pid_t pid = _forkBuiltin(stage_cmds[i], pgid, in_fd, out_fd, redirect_to, pipe_fds);
+      if(pid > 0) {
+        if(pgid == 0) pgid = pid;
+        stage_pids.push_back(pid);
+      }
+      continue;
+    }
 
-  if(!getcwd(curr_path, MAX_PATH)){
+    RedirectionCommand* redirect_cmd = dynamic_cast<RedirectionCommand*>(stage_cmds[i]);
+    ExternalCommand* external_cmd = _stageExternal(stage_cmds[i]);
+    LaunchSpec spec(external_cmd->argv);
+    spec.pgid = pgid;
+    if(in_fd >= 0) spec.addDup(in_fd, 0);
+    if(out_fd >= 0) spec.addDup(out_fd, redirect_to);
+    // the stage's own redirections come after the pipes, "cmd 2>&1 | ..." pipes stderr too
+    pid_t pid = -1;
+    if(redirect_cmd == nullptr || redirect_cmd->prepare()) {
+      if(redirect_cmd != nullptr) external_cmd->redirect_actions = redirect_cmd->fd_actions;
+      pid = external_cmd->launch(spec);
+    }
+    if(redirect_cmd != nullptr) redirect_cmd->cleanup();
+
+    if(pid > 0) {
+      if(pgid == 0) pgid = pid;
+      stage_pids.push_back(pid);
+    }
+  }
+
+  // the external stages are the foreground job: ctrl-C and ctrl-Z go to their
+  // process group (a pipeline run by a built-in, e.g. cached, hands it back)
+  pid_t outer_fg_pid = smash.curr_fg_pid;
+  string outer_fg_cmd = smash.curr_fg_cmd;
+  if(pgid > 0) {
+    smash.curr_fg_pid = pgid;
+    smash.curr_fg_cmd = cmd;
+  }
+
+  // smash keeps only the pipe ends between a built-in and an external stage,
+  // so every reader sees EOF once its writers are done
+  for(int i = 0; i < num_stages - 1; ++i) {
+    int& read_end = pipe_fds[2 * i];
+    int& write_end = pipe_fds[2 * i + 1];
+    if(!is_builtin[i + 1] || is_builtin[i]) {
+      close(read_end);
+      read_end = -1;
+    }
+    if(!is_builtin[i] || is_builtin[i + 1]) {
+      close(write_end);
+      write_end = -1;
+    }
+  }
+
+  vector<thread> writers;
+  int prev_output = -1; // memfd with the output of the previous stage, if it is a built-in
+  int builtin_status = -1;
+  for(int i = 0; i <= last_builtin; ++i) {
+    if(!is_builtin[i]) continue;
+    int in_fd = -1;
+    if(i > 0) {
+      in_fd = is_builtin[i - 1] ? prev_output : pipe_fds[2 * (i - 1)];
+      pipe_fds[2 * (i - 1)] = -1;
+    }
+    prev_output = -1;
+    bool captured = i < last_builtin;
+    int out_fd = -1;
+    if(captured && (out_fd = _moveAboveUserFds(memfd_create("smash-pipe", MFD_CLOEXEC))) < 0) {
+      perror("smash error: memfd_create failed");
+    } else if(!captured && i < num_stages - 1) {
+      out_fd = pipe_fds[2 * i + 1];
+      pipe_fds[2 * i + 1] = -1;
+    }
+
+    vector<LaunchSpec::FdAction> fd_actions;
+    if(in_fd >= 0) fd_actions.push_back(LaunchSpec::dupAction(in_fd, 0));
+    if(out_fd >= 0) fd_actions.push_back(LaunchSpec::dupAction(out_fd, stages[i].type == SMASH_REG_PIPE ? 1 : 2));
+    vector<pair<int, int>> saved_fds;
+    smash.last_status = 0;
+    cout.flush();
+    if(_redirectInProcess(fd_actions, &saved_fds)) {
+      stage_cmds[i]->execute();
+    }
+    cout.flush();
+    _restoreFds(saved_fds);
+    cout.clear(); // a reader that went away leaves cout failed with EPIPE
+    if(i == num_stages - 1) builtin_status = smash.last_status;
+
+    if(in_fd >= 0) close(in_fd);
+    if(!captured || out_fd < 0) {
+      if(out_fd >= 0) close(out_fd);
+      continue;
+    }
+    lseek(out_fd, 0, SEEK_SET);
+    if(is_builtin[i + 1]) {
+      prev_output = out_fd;
+    } else {
+      writers.push_back(thread(_pumpOutput, out_fd, pipe_fds[2 * i + 1]));
+      pipe_fds[2 * i + 1] = -1;
+    }
+  }
+  for(auto it = writers.begin(); it != writers.end(); ++it) {
+    it->join();
+  }
+  _closePipes(pipe_fds);
+
+  // status of a pipeline is the status of its last stage; once a stage
+  // stops, the whole group is a stopped job (ctrl-Z already added it)
+  TraceSpan wait_span(smash.profiler, SMASH_PHASE_WAIT);
+  bool stopped = false;
+  for(auto it = stage_pids.begin(); it != stage_pids.end() && !stopped; ++it) {
+    int status;
+    struct rusage usage;
+    if(smash.waitChild(*it, &status, WUNTRACED, &usage) < 0) {
+      perror("smash error: waitpid failed");
+      continue;
+    }
+    _addUsage(&smash.fg_usage, usage);
+    smash.last_status = _exitStatus(status);
+    stopped = WIFSTOPPED(status);
+  }
+  if(stopped && smash.jobs.getJobByPid(pgid) == nullptr) {
+    smash.jobs.addJob(cmd, pgid, true);
+  }
+  if(builtin_status >= 0 && !stopped) smash.last_status = builtin_status;
+  smash.curr_fg_pid = outer_fg_pid;
+  smash.curr_fg_cmd = outer_fg_cmd;
+
+  for(auto it = stage_cmds.begin(); it != stage_cmds.end(); ++it) {
+    delete *it;
+  }
+}
+
+
+// ============= Built in Command ============ //
+BuiltInCommand::BuiltInCommand(CommandLine* line) : Command(line) {
+  expandGlobs();
+}
+
+// ============= GCWD Command ============== //
+GetCurrDirCommand::GetCurrDirCommand(CommandLine* line) : BuiltInCommand(line) {
+}
+
+void GetCurrDirCommand::execute() {
+  const int MAX_PATH = 200;
+
+  char path[MAX_PATH];
+
+  if(!getcwd(path, MAX_PATH)) {
+    perror("smash error: getcwd failed");
+    return;
+  }
+
+  cout << path << "\n";
+}
+
+
+// ============= chprompt Comamand ============ //
+CHPromptCommand::CHPromptCommand(CommandLine* line) : BuiltInCommand(line) {
+}
+
+void CHPromptCommand::execute() {
+  SmallShell& shell = SmallShell::getInstance();
+  if(argc == 1) { // no args
+    shell.setPromptMessage("smash");
+  } else { // 2 or more args
+    shell.setPromptMessage(argv[1]);
+  }
+}
+
+// ============= showPID Command ============== //
+ShowPidCommand::ShowPidCommand(CommandLine* line) : BuiltInCommand(line) {
+}
+
+void ShowPidCommand::execute() {
+  SmallShell& smash = SmallShell::getInstance();
+  cout << "smash pid is " << smash.smash_pid << "\n";
+}
+
+// ============= CD Command ============== //
+ChangeDirCommand::ChangeDirCommand(CommandLine* line) :
+  BuiltInCommand(line) {}
+
+void ChangeDirCommand::execute() {
+  if(argc > 2){
+    cerr << "smash error: cd: too many arguments\n";
+    return;
+  }
+
+  // if no arguments, do nothing
+  if(argc == 1) {
+    return;
+  }
+
+  const int MAX_PATH = 200;
+  char curr_path[MAX_PATH];
+
+  if(!getcwd(curr_path, MAX_PATH)){
     perror("smash error: getcwd failed");
     return;
   }
@@ -544,16 +1354,16 @@ void ChangeDirCommand::execute() {
 }
 
 // ============= Quit Command ============== //
-QuitCommand::QuitCommand(const char* cmd_line, JobsList* jobs) :
-  BuiltInCommand(cmd_line) {}
+QuitCommand::QuitCommand(CommandLine* line, JobsList* jobs) :
+  BuiltInCommand(line) {}
 
 void QuitCommand::execute() {
   SmallShell& smash = SmallShell::getInstance();
   if(argc > 1){
     if(strcmp(argv[1], "kill") == 0) {
-      cout << "smash: sending SIGKILL signal to " << smash.jobs.job_vector.size() << " jobs:\n";
-      for(auto it = smash.jobs.job_vector.begin(); it != smash.jobs.job_vector.end(); ++it) {
-        cout << it->process_id << ": " << it->cmd << "\n";
+      cout << "smash: sending SIGKILL signal to " << smash.jobs.size() << " jobs:\n";
+      for(JobsList::JobEntry* job = smash.jobs.first_job; job != nullptr; job = job->next) {
+        cout << job->process_id << ": " << job->cmd << "\n";
       }
       smash.jobs.killAllJobs();
     }
@@ -562,278 +1372,2604 @@ void QuitCommand::execute() {
   exit(0);
 }
 
-// ====================== External Command ======================== //
+// ====================== Data Pump ======================== //
+const size_t PUMP_CHUNK_SIZE = 1 << 16; // default pipe capacity
 
-ExternalCommand::ExternalCommand(const char* cmd_line) : Command(cmd_line), is_background(false) {
-  if(_isBackgroundComamnd(cmd_line)){ // handle background command construction
-    is_background = true;
-    
-    // fixing last argument, removing & TODO: (Aviv) find a better way
-    char effective_cmd[COMMAND_ARGS_MAX_LENGTH];
-    strcpy(effective_cmd, cmd_line);
-    _removeBackgroundSign(effective_cmd);
-    
-    // free old argv
-    for(int i = 0 ;i < argc; ++i){
-      if(argv[i]) free(argv[i]);
+bool _isPipe(int fd) {
+  struct stat fd_stat;
+  return fstat(fd, &fd_stat) == 0 && S_ISFIFO(fd_stat.st_mode);
+}
+
+bool _isRegularFile(int fd) {
+  struct stat fd_stat;
+  return fstat(fd, &fd_stat) == 0 && S_ISREG(fd_stat.st_mode);
+}
+
+// writes all len bytes of buf, retrying on short writes
+bool _writeAll(int fd, const char* buf, size_t len) {
+  while(len > 0) {
+    ssize_t written = write(fd, buf, len);
+    if(written < 0) {
+      if(errno == EINTR) continue;
+      return false;
+    }
+    buf += written;
+    len -= written;
+  }
+  return true;
+}
+
+ssize_t DataPump::copy(int in_fd, int out_fd) {
+  char buf[PUMP_CHUNK_SIZE];
+  ssize_t total = 0;
+  while(true) {
+    ssize_t bytes_read = read(in_fd, buf, sizeof(buf));
+    if(bytes_read < 0) {
+      if(errno == EINTR) continue;
+      perror("smash error: read failed");
+      return -1;
+    }
+    if(bytes_read == 0) return total;
+    if(!_writeAll(out_fd, buf, bytes_read)) {
+      if(errno != EPIPE) perror("smash error: write failed"); // a reader going away is no error
+      return -1;
+    }
+    total += bytes_read;
+  }
+}
+
+ssize_t DataPump::pump(int in_fd, int out_fd) {
+  ssize_t total = 0;
+
+  // splice needs a pipe on at least one side
+  if(_isPipe(in_fd) || _isPipe(out_fd)) {
+    while(true) {
+      ssize_t moved = splice(in_fd, nullptr, out_fd, nullptr, PUMP_CHUNK_SIZE, SPLICE_F_MOVE | SPLICE_F_MORE);
+      if(moved < 0) {
+        if(errno == EINTR) continue;
+        if(total == 0 && errno == EINVAL) break; // fd type not supported, use sendfile/copy
+        if(errno != EPIPE) perror("smash error: splice failed");
+        return -1;
+      }
+      if(moved == 0) return total;
+      total += moved;
+    }
+  }
+
+  // sendfile reads from anything mmap-able, in practice a regular file
+  if(_isRegularFile(in_fd)) {
+    while(true) {
+      ssize_t moved = sendfile(out_fd, in_fd, nullptr, PUMP_CHUNK_SIZE);
+      if(moved < 0) {
+        if(errno == EINTR) continue;
+        if(total == 0 && errno == EINVAL) break;
+        if(errno != EPIPE) perror("smash error: sendfile failed");
+        return -1;
+      }
+      if(moved == 0) return total;
+      total += moved;
+    }
+  }
+
+  ssize_t copied = copy(in_fd, out_fd);
+  return copied < 0 ? -1 : total + copied;
+}
+
+// ====================== Launch Spec ======================== //
+LaunchSpec::LaunchSpec(char* const* argv) : argv(argv), pgid(0), has_affinity(false) {
+  CPU_ZERO(&affinity);
+}
+
+LaunchSpec::FdAction LaunchSpec::dupAction(int src_fd, int fd) {
+  FdAction action = {SMASH_FD_DUP, fd, src_fd};
+  return action;
+}
+
+LaunchSpec::FdAction LaunchSpec::closeAction(int fd) {
+  FdAction action = {SMASH_FD_CLOSE, fd, -1};
+  return action;
+}
+
+void LaunchSpec::addDup(int src_fd, int fd) {
+  fd_actions.push_back(dupAction(src_fd, fd));
+}
+
+void LaunchSpec::setAffinity(const cpu_set_t& cpus) {
+  has_affinity = true;
+  affinity = cpus;
+}
+
+// posix_spawn path: glibc implements it with clone(CLONE_VM|CLONE_VFORK), so
+// the page tables of smash are never copied no matter how large smash grows.
+// exec failures are reported back to the parent: returns 0 or an errno value.
+int _spawnProcess(const LaunchSpec& spec, const char* path, pid_t* pid) {
+  posix_spawnattr_t attr;
+  posix_spawn_file_actions_t file_actions;
+
+  // like posix_spawn itself, the init calls return the error instead of setting errno
+  int err = posix_spawnattr_init(&attr);
+  if(err != 0) {
+    return err;
+  }
+  if((err = posix_spawn_file_actions_init(&file_actions)) != 0) {
+    posix_spawnattr_destroy(&attr);
+    return err;
+  }
+
+  sigset_t empty_mask;
+  sigemptyset(&empty_mask);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK);
+  posix_spawnattr_setpgroup(&attr, spec.pgid);
+  posix_spawnattr_setsigmask(&attr, &empty_mask);
+
+  for(auto it = spec.fd_actions.begin(); it != spec.fd_actions.end(); ++it) {
+    switch(it->type) {
+      case LaunchSpec::SMASH_FD_DUP:
+        posix_spawn_file_actions_adddup2(&file_actions, it->src_fd, it->fd);
+        break;
+      case LaunchSpec::SMASH_FD_CLOSE:
+        posix_spawn_file_actions_addclose(&file_actions, it->fd);
+        break;
+    }
+  }
+
+  // posix_spawn has no affinity attribute, but the child inherits the mask
+  // of smash: switch to the wanted mask just for the spawn
+  cpu_set_t smash_affinity;
+  bool pinned = false;
+  if(spec.has_affinity) {
+    if(sched_getaffinity(0, sizeof(cpu_set_t), &smash_affinity) < 0 ||
+       sched_setaffinity(0, sizeof(cpu_set_t), &spec.affinity) < 0) {
+      perror("smash error: sched_setaffinity failed");
+    } else {
+      pinned = true;
+    }
+  }
+
+  err = posix_spawn(pid, path, &file_actions, &attr, spec.argv, environ);
+
+  if(pinned && sched_setaffinity(0, sizeof(cpu_set_t), &smash_affinity) < 0) {
+    perror("smash error: sched_setaffinity failed");
+  }
+  posix_spawn_file_actions_destroy(&file_actions);
+  posix_spawnattr_destroy(&attr);
+  return err;
+}
+
+// classic path: full fork() of smash, then the same setup done by hand
+pid_t _forkProcess(const LaunchSpec& spec, const char* path) {
+  pid_t pid = fork();
+  if(pid < 0) {
+    perror("smash error: fork failed");
+    return -1;
+  }
+  if(pid > 0) return pid;
+
+  // child process, the signals smash reads from its signalfd are blocked.
+  // It must leave with _exit: exit would run smash's atexit handlers and
+  // static destructors (trace file, history) in this copy of smash.
+  sigset_t empty_mask;
+  sigemptyset(&empty_mask);
+  if(sigprocmask(SIG_SETMASK, &empty_mask, nullptr) < 0) {
+    perror("smash error: sigprocmask failed");
+    _exit(1);
+  }
+  if(setpgid(0, spec.pgid) < 0) {
+    perror("smash error: setpgrp failed");
+    _exit(1);
+  }
+  for(auto it = spec.fd_actions.begin(); it != spec.fd_actions.end(); ++it) {
+    if(it->type == LaunchSpec::SMASH_FD_DUP) {
+      if(dup2(it->src_fd, it->fd) < 0) {
+        perror("smash error: dup2 failed");
+        _exit(1);
+      }
+    } else if(close(it->fd) < 0 && errno != EBADF) { // like posix_spawn, closing a closed fd is fine
+      perror("smash error: close failed");
+      _exit(1);
+    }
+  }
+  if(spec.has_affinity && sched_setaffinity(0, sizeof(cpu_set_t), &spec.affinity) < 0) {
+    perror("smash error: sched_setaffinity failed");
+  }
+  execv(path, spec.argv);
+  if(errno == ENOENT) { // stale cache entry, let execvp search PATH again
+    execvp(spec.argv[0], spec.argv);
+  }
+
+  // if reached here, execvp failed: 127 like a command that was not found
+  perror("smash error: execvp failed");
+  _exit(127);
+}
+
+/**
+* Starts an external process as described by spec, using the launch engine
+* selected by launch_mode. Returns the child pid, or -1 if it could not be started.
+*/
+pid_t SmallShell::launchProcess(const LaunchSpec& spec) {
+  cout.flush(); // anything smash printed so far goes before the child's output
+  TraceSpan spawn_span(profiler, SMASH_PHASE_SPAWN);
+  string name = spec.argv[0];
+  string path = name;
+  bool cached = name.find('/') == string::npos;
+  if(cached && !path_cache.lookup(name, &path)) {
+    errno = ENOENT;
+    perror("smash error: execvp failed");
+    last_status = 127;
+    return -1;
+  }
+
+  if(launch_mode == SMASH_LAUNCH_FORK) {
+    return _forkProcess(spec, path.c_str());
+  }
+
+  pid_t pid = -1;
+  int err = _spawnProcess(spec, path.c_str(), &pid);
+  if(err == ENOENT && cached) { // binary went missing since it was cached, resolve again
+    path_cache.forget(name);
+    if(path_cache.lookup(name, &path, false)) {
+      err = _spawnProcess(spec, path.c_str(), &pid);
+    }
+  }
+  if(err != 0) {
+    errno = err;
+    perror("smash error: execvp failed");
+    last_status = 127;
+    return -1;
+  }
+  return pid;
+}
+
+// ====================== Command Path Cache ======================== //
+bool _isExecutableFile(const string& path) {
+  struct stat file_stat;
+  return stat(path.c_str(), &file_stat) == 0 && S_ISREG(file_stat.st_mode) &&
+         access(path.c_str(), X_OK) == 0;
+}
+
+/**
+* Finds the file executed for command name, like execvp would. Results found
+* through absolute PATH entries are cached, relative ones depend on the cwd.
+*/
+bool CommandPathCache::lookup(const string& name, string* path, bool count_hit) {
+  const char* env = getenv("PATH");
+  string curr_path_env = env ? env : "/bin:/usr/bin";
+  if(curr_path_env != path_env) {
+    entries.clear();
+    path_env = curr_path_env;
+  }
+
+  auto it = entries.find(name);
+  if(it != entries.end()) {
+    if(count_hit) it->second.hits++;
+    *path = it->second.path;
+    return true;
+  }
+
+  size_t dir_start = 0;
+  while(dir_start <= path_env.length()) {
+    size_t dir_end = path_env.find(':', dir_start);
+    if(dir_end == string::npos) dir_end = path_env.length();
+    string dir = path_env.substr(dir_start, dir_end - dir_start);
+    dir_start = dir_end + 1;
+
+    if(dir.empty()) dir = ".";
+    string candidate = dir + "/" + name;
+    if(!_isExecutableFile(candidate)) continue;
+
+    *path = candidate;
+    if(dir[0] == '/') {
+      Entry entry = {candidate, count_hit ? 1ul : 0ul};
+      entries[name] = entry;
+    }
+    return true;
+  }
+  return false;
+}
+
+void CommandPathCache::forget(const string& name) {
+  entries.erase(name);
+}
+
+void CommandPathCache::clear() {
+  entries.clear();
+}
+
+void CommandPathCache::print() const {
+  if(entries.empty()) {
+    cout << "hash: hash table empty\n";
+    return;
+  }
+  // print sorted by path so the output is stable
+  vector<const Entry*> sorted_entries;
+  for(auto it = entries.begin(); it != entries.end(); ++it) {
+    sorted_entries.push_back(&it->second);
+  }
+  sort(sorted_entries.begin(), sorted_entries.end(),
+       [](const Entry* a, const Entry* b) { return a->path < b->path; });
+
+  cout << "hits\tcommand\n";
+  for(auto it = sorted_entries.begin(); it != sorted_entries.end(); ++it) {
+    cout << setw(4) << (*it)->hits << "\t" << (*it)->path << "\n";
+  }
+}
+
+// ========================= Hash Command =========================== //
+HashCommand::HashCommand(CommandLine* line) : BuiltInCommand(line) {}
+
+void HashCommand::execute() {
+  SmallShell& smash = SmallShell::getInstance();
+
+  if(argc == 1) {
+    smash.path_cache.print();
+    return;
+  }
+
+  if(strcmp(argv[1], "-r") == 0) { // forget everything
+    if(argc != 2) {
+      cerr << "smash error: hash: invalid arguments\n";
+      return;
+    }
+    smash.path_cache.clear();
+    return;
+  }
+
+  if(strcmp(argv[1], "-d") == 0) { // forget the given names
+    if(argc < 3) {
+      cerr << "smash error: hash: invalid arguments\n";
+      return;
+    }
+    for(int i = 2; i < argc; ++i) {
+      if(smash.path_cache.entries.count(argv[i]) == 0) {
+        cerr << "smash error: hash: " << argv[i] << ": not found\n";
+        continue;
+      }
+      smash.path_cache.forget(argv[i]);
+    }
+    return;
+  }
+
+  // resolve and remember the given names without running them
+  for(int i = 1; i < argc; ++i) {
+    string path;
+    if(strchr(argv[i], '/') != nullptr) continue;
+    if(!smash.path_cache.lookup(argv[i], &path, false)) {
+      cerr << "smash error: hash: " << argv[i] << ": not found\n";
     }
+  }
+}
+
+// ====================== External Command ======================== //
+
+ExternalCommand::ExternalCommand(CommandLine* line) :
+  Command(line), is_background(line->is_background), timeout_ms(-1) {
+  expandGlobs();
+}
 
-    // make new argv without &
-    argc = _parseCommandLine(effective_cmd,argv);
+/**
+* Starts this command as described by spec without waiting for it.
+* spec.argv is replaced by the "bash -c" form for complex commands.
+*/
+pid_t ExternalCommand::launch(LaunchSpec& spec) {
+  if(argc == 0) { // nothing to run, e.g. an empty pipeline stage
+    return -1;
+  }
+  spec.fd_actions.insert(spec.fd_actions.end(), redirect_actions.begin(), redirect_actions.end());
+  // check if complex external command or not
+  if(_isComplexExternalCommand(*line)){ // complex command
+    static char bash[] = "/bin/bash";
+    static char cflag[] = "-c";
+    complex_cmd = line->raw;
+    complex_args[0] = bash;
+    complex_args[1] = cflag;
+    complex_args[2] = &complex_cmd[0];
+    complex_args[3] = nullptr;
+    spec.argv = complex_args;
   }
+  return SmallShell::getInstance().launchProcess(spec);
 }
 
 void ExternalCommand::execute() {
   SmallShell& smash = SmallShell::getInstance();
-  pid_t pid = fork();
 
+  LaunchSpec spec(argv);
+  cpu_set_t cpus;
+  if(is_background && smash.placement.choose(&cpus)) {
+    spec.setAffinity(cpus);
+  }
+  pid_t pid = launch(spec);
   if(pid < 0){
-    perror("smash error: fork failed");
     return;
   }
+  if(timeout_ms >= 0) {
+    smash.timers.arm(pid, timeout_ms, cmd);
+  }
+
+  if(is_background){ // background command
+    smash.jobs.removeFinishedJobs(); // need to remove finished jobs before adding new job
+    smash.jobs.addJob(cmd, pid);
+  }
+  else { // foreground command
+    // run from a built-in stage of a pipeline ("timeout 9 cmd | sleep 4"),
+    // the pipeline is the foreground job again once this command is done
+    pid_t outer_fg_pid = smash.curr_fg_pid;
+    string outer_fg_cmd = smash.curr_fg_cmd;
+    smash.curr_fg_pid = pid;
+    smash.curr_fg_cmd = cmd;
+    int status;
+    struct rusage usage;
+    TraceSpan wait_span(smash.profiler, SMASH_PHASE_WAIT);
+    if(smash.waitChild(pid, &status, WUNTRACED, &usage) < 0){
+      perror("smash error: waitpid failed");
+      // clean shell state
+      smash.curr_fg_pid = outer_fg_pid;
+      smash.curr_fg_cmd = outer_fg_cmd;
+      return;
+    }
+    _addUsage(&smash.fg_usage, usage);
+    // a stopped process keeps its deadline, it is cancelled when the job ends
+    if(!WIFSTOPPED(status)) {
+      smash.timers.cancel(pid);
+    } else {
+      JobsList::JobEntry* job = smash.jobs.getJobByPid(pid);
+      if(job != nullptr) job->usage = usage;
+    }
+    smash.last_status = _exitStatus(status);
+    // at this point, child process is finished
+    smash.curr_fg_pid = outer_fg_pid;
+    smash.curr_fg_cmd = outer_fg_cmd;
+  }
+}
+
+// ======================== JobsCommand =========================== //
+JobsCommand::JobsCommand(CommandLine* line) : BuiltInCommand(line) {}
+
+// jobs [-v]: -v adds the cpu time, peak memory, page faults and context switches of each job
+void JobsCommand::execute() {
+  SmallShell& smash = SmallShell::getInstance();
+  bool verbose = argc == 2 && strcmp(argv[1], "-v") == 0;
+  smash.jobs.removeFinishedJobs(); // need to remove finished jobs before adding new job
+  smash.jobs.printJobsList(verbose);
+}
+
+// ========================= Foreground Command ==================== //
+ForegroundCommand::ForegroundCommand(CommandLine* line) : BuiltInCommand(line) {}
+
+void ForegroundCommand::execute() {
+  SmallShell& smash = SmallShell::getInstance();
+  JobsList::JobEntry* job_to_fg = nullptr;
+  int job_id_to_fg = 0;
+  
+  // check input and find job_to_fg
+  if(argc > 2){
+    cerr << "smash error: fg: invalid arguments\n";
+    return;
+  }
+  if(argc == 1){
+    if(smash.jobs.empty()){
+      cerr << "smash error: fg: jobs list is empty\n";
+      return;
+    }
+    job_to_fg = smash.jobs.getLastJob(&job_id_to_fg);
+  } else if(argc == 2){
+    try {
+      job_id_to_fg = stoi(argv[1]);
+    } catch(const exception& e){
+      cerr << "smash error: fg: invalid arguments\n";
+      return;
+    }
+    job_to_fg = smash.jobs.getJobById(job_id_to_fg);
+    if(job_to_fg == nullptr) {
+      cerr << "smash error: fg: job-id " << job_id_to_fg << " does not exist\n";
+      return;
+    }
+  }
+  // end of input check, reaching here means job_to_fg has been found
+  // every job leads its own process group, a stopped pipeline continues as a whole
+  if(kill(-job_to_fg->process_id, SIGCONT) < 0){
+    perror("smash error: kill failed");
+    return;
+  }
+  int job_process_id = job_to_fg->process_id;
+  string job_cmd = job_to_fg->cmd;
+
+  smash.curr_fg_pid = job_process_id;
+  smash.curr_fg_cmd = job_cmd;
+  smash.curr_fg_jobid = job_id_to_fg;
+
+  cout << job_cmd << " : " << job_process_id << "\n";
+
+  // the job is done when no process of its group is left, or stopped when one of them stops
+  int status = 0;
+  struct rusage usage;
+  pid_t waited;
+  TraceSpan wait_span(smash.profiler, SMASH_PHASE_WAIT);
+  while((waited = smash.waitChild(-job_process_id, &status, WUNTRACED, &usage)) > 0) {
+    _addUsage(&smash.fg_usage, usage);
+    if(WIFSTOPPED(status)) break;
+  }
+  if(waited < 0 && errno != ECHILD) {
+    perror("smash error: waitpid failed");
+  }
+  // a stopped job was already updated on ctrl-Z (handleSignals), a finished one leaves the list
+  if(waited <= 0 || !WIFSTOPPED(status)) {
+    smash.jobs.removeJobById(job_id_to_fg);
+  } else {
+    JobsList::JobEntry* job = smash.jobs.getJobById(job_id_to_fg);
+    if(job != nullptr) job->usage = usage;
+  }
+  // at this point, process is finished
+  smash.curr_fg_pid = -1;
+  smash.curr_fg_cmd = "";
+  smash.curr_fg_jobid = -1;
+}
+
+// ========================= Background Command ===================== //
+BackgroundCommand::BackgroundCommand(CommandLine* line) : BuiltInCommand(line) {}
+
+void BackgroundCommand::execute() {
+    SmallShell& smash = SmallShell::getInstance();
+    JobsList::JobEntry* job_to_bg = nullptr;
+    int job_id_to_bg = 0;
+    
+    // check input and find job_to_bg
+    if(argc > 2){
+      cerr << "smash error: bg: invalid arguments\n";
+      return;
+    }
+    if(argc == 1){
+      job_to_bg = smash.jobs.getLastStoppedJob(&job_id_to_bg);
+      if(job_to_bg == nullptr){
+        cerr << "smash error: bg: there is no stopped jobs to resume\n";
+        return;
+      }
+    } else if(argc == 2){
+      try {
+        job_id_to_bg = stoi(argv[1]);
+      } catch(const exception& e){
+        cerr << "smash error: bg: invalid arguments\n";
+        return;
+      }
+      job_to_bg = smash.jobs.getJobById(job_id_to_bg);
+      if(job_to_bg == nullptr) {
+        cerr << "smash error: bg: job-id " << job_id_to_bg << " does not exist\n";
+        return;
+      }
+    }
+    // end of input check, reaching here means job_to_bg has been found
+    if(job_to_bg->is_stopped == false) {
+      cerr << "smash error: bg: job-id " << job_id_to_bg << " is already running in the background\n";
+      return;
+    }
+
+    if(kill(-job_to_bg->process_id, SIGCONT) < 0){
+      perror("smash error: kill failed");
+      return;
+    }
+    cout << job_to_bg->cmd << " : " << job_to_bg->process_id << "\n";
+
+    smash.jobs.setJobStopped(job_to_bg, false);
+}
+
+// ========================= Kill Command =========================== //
+KillCommand::KillCommand(CommandLine* line) : BuiltInCommand(line) {}
+
+void KillCommand::execute() {
+  SmallShell& smash = SmallShell::getInstance();
+
+  if(argc != 3){
+    cerr << "smash error: kill: invalid arguments\n";
+    return;
+  }
+
+  int sig_flag;
+  int job_id;
+
+  // validate arguments, convert to integers.
+  string sig_flag_str = argv[1];
+  string job_id_str = argv[2];
+
+  if(sig_flag_str[0] != '-') {
+    cerr << "smash error: kill: invalid arguments\n";
+    return;
+  }
+  sig_flag_str.erase(0,1); // remove "-" from sig flag arg
+
+  try{
+    sig_flag = stoi(sig_flag_str);
+    job_id = stoi(job_id_str);
+  } catch (const exception& e) {
+    cerr << "smash error: kill: invalid arguments\n";
+    return;
+  }
+
+  JobsList::JobEntry* job = smash.jobs.getJobById(job_id);
+  if(job == nullptr){
+    cerr << "smash error: kill: job-id " << job_id << " does not exist\n";
+    return;
+  }
+
+  int pid = job->process_id;
+
+  // reaching here means args are valid, the signal goes to the job's whole process group
+  if(kill(-pid, sig_flag) < 0){
+    perror("smash error: kill failed");
+    return;
+  }
+
+  // updating joblist
+  if(sig_flag == SIGSTOP || sig_flag == SIGTSTP) {
+    smash.jobs.setJobStopped(job, true);
+  }
+
+  if(sig_flag == SIGCONT) {
+    smash.jobs.setJobStopped(job, false);
+  }
+
+  cout << "signal number " << sig_flag << " was sent to pid " << pid << "\n";
+}
+
+// ========================= Timeout Command ======================== //
+TimeoutCommand::TimeoutCommand(CommandLine* line) : BuiltInCommand(line) {}
+
+void TimeoutCommand::execute() {
+  SmallShell& smash = SmallShell::getInstance();
+
+  // timeout <duration> <command>: the command is every token after the duration
+  if(argc < 3 || line->num_tokens < 3 || line->tokens[2].type != SMASH_TOKEN_WORD) {
+    cerr << "smash error: timeout: invalid arguments\n";
+    return;
+  }
+
+  int duration;
+  try {
+    size_t parsed_len;
+    duration = stoi(argv[1], &parsed_len);
+    if(parsed_len != strlen(argv[1]) || duration < 0) throw invalid_argument(argv[1]);
+  } catch(const exception& e) {
+    cerr << "smash error: timeout: invalid arguments\n";
+    return;
+  }
+
+  Command* timed_cmd = smash.CreateCommand(new CommandLine(*line, 2, line->num_tokens));
+  timed_cmd->cmd = cmd; // jobs list and the timeout message show the whole line
+  ExternalCommand* external_cmd = dynamic_cast<ExternalCommand*>(timed_cmd);
+  if(external_cmd != nullptr) {
+    external_cmd->timeout_ms = duration * 1000L;
+  }
+  // built-ins run to completion right away, so they never time out
+  timed_cmd->execute();
+  delete timed_cmd;
+}
+
+// ======================== Parallel Command ======================== //
+ParallelCommand::ParallelCommand(CommandLine* line) :
+  BuiltInCommand(line), max_jobs(0), pin_workers(false) {}
+
+// quotes s so the lexer reads it back as exactly one word
+string _quoteWord(const string& s) {
+  string quoted = "'";
+  for(size_t i = 0; i < s.length(); ++i) {
+    if(s[i] == '\'') quoted += "'\\''";
+    else quoted += s[i];
+  }
+  return quoted + "'";
+}
+
+bool ParallelCommand::parseArgs() {
+  // options and the command come from the tokens (the command is kept
+  // unexpanded), the inputs from argv, so wildcards in them are expanded
+  int token = 1;
+  for(; token < line->num_tokens && line->tokens[token].type == SMASH_TOKEN_WORD; ++token) {
+    const char* word = line->tokens[token].text;
+    if(strcmp(word, "-p") == 0) {
+      pin_workers = true;
+    } else if(strcmp(word, "-j") == 0 && token + 1 < line->num_tokens) {
+      try {
+        size_t parsed_len;
+        const char* count = line->tokens[++token].text;
+        max_jobs = stoi(count, &parsed_len);
+        if(parsed_len != strlen(count) || max_jobs <= 0) return false;
+      } catch(const exception& e) {
+        return false;
+      }
+    } else {
+      break;
+    }
+  }
+
+  int separator = token;
+  while(separator < line->num_tokens && line->tokens[separator].type == SMASH_TOKEN_WORD &&
+        strcmp(line->tokens[separator].text, ":::") != 0 && strcmp(line->tokens[separator].text, "::::") != 0) {
+    ++separator;
+  }
+  if(separator == token || separator >= line->num_tokens || line->tokens[separator].type != SMASH_TOKEN_WORD) {
+    return false;
+  }
+  cmd_template = line->text(token, separator);
+  bool from_files = strcmp(line->tokens[separator].text, "::::") == 0;
+
+  int arg = 0;
+  while(arg < argc && strcmp(argv[arg], line->tokens[separator].text) != 0) ++arg;
+  for(++arg; arg < argc; ++arg) {
+    if(!from_files) {
+      inputs.push_back(argv[arg]);
+      continue;
+    }
+    // :::: names files with one input per line
+    int fd = open(argv[arg], O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+      perror("smash error: open failed");
+      return false;
+    }
+    LineReader reader(fd);
+    string input;
+    while(reader.readLine(input)) {
+      if(!input.empty()) inputs.push_back(input);
+    }
+    close(fd);
+  }
+
+  if(max_jobs == 0) {
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    max_jobs = num_cpus > 0 ? num_cpus : 1;
+  }
+  return true;
+}
+
+/**
+* Launches the command for inputs[input_idx] into pgid (0 for a new group),
+* with its stdout going to a fresh memfd. Returns false if it didn't start.
+*/
+bool ParallelCommand::startJob(size_t input_idx, Job& job, pid_t pgid, const vector<int>& cpus) {
+  string job_line = cmd_template;
+  string input = _quoteWord(inputs[input_idx]);
+  size_t placeholder = job_line.find("{}");
+  if(placeholder == string::npos) {
+    job_line += " " + input;
+  }
+  for(; placeholder != string::npos; placeholder = job_line.find("{}", placeholder + input.length())) {
+    job_line.replace(placeholder, 2, input);
+  }
+
+  if((job.output_fd = memfd_create("smash-parallel", MFD_CLOEXEC)) < 0) {
+    perror("smash error: memfd_create failed");
+    return false;
+  }
+
+  ExternalCommand job_cmd(new CommandLine(job_line.c_str()));
+  LaunchSpec spec(job_cmd.argv);
+  spec.pgid = pgid;
+  spec.addDup(job.output_fd, 1);
+  // each worker slot owns one of smash's cpus
+  if(pin_workers && !cpus.empty()) {
+    cpu_set_t core_set;
+    CPU_ZERO(&core_set);
+    CPU_SET(cpus[job.slot % cpus.size()], &core_set);
+    spec.setAffinity(core_set);
+  }
+  job.pid = job_cmd.launch(spec);
+  return job.pid >= 0;
+}
+
+// Runs the jobs through a pool of max_jobs slots: whenever a job ends its
+// slot takes the next input, so a slow input never holds back the others.
+// Outputs are printed in input order, each as soon as all earlier jobs
+// have printed theirs. The status is the number of failed jobs (101 means
+// more than 100), like GNU parallel.
+void ParallelCommand::execute() {
+  SmallShell& smash = SmallShell::getInstance();
+  if(!parseArgs()) {
+    cerr << "smash error: parallel: invalid arguments\n";
+    return;
+  }
+  CommandLine template_line(cmd_template.c_str());
+  if(template_line.is_background || _findBuiltin(template_line.firstWord()) != nullptr) {
+    cerr << "smash error: parallel: invalid arguments\n";
+    return;
+  }
+
+  vector<int> cpus;
+  if(pin_workers) {
+    cpu_set_t allowed;
+    if(sched_getaffinity(0, sizeof(cpu_set_t), &allowed) < 0) {
+      perror("smash error: sched_getaffinity failed");
+    } else {
+      for(int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if(CPU_ISSET(cpu, &allowed)) cpus.push_back(cpu);
+      }
+    }
+  }
+
+  size_t num_jobs = inputs.size();
+  Job not_started = {-1, -1, -1, false};
+  vector<Job> jobs(num_jobs, not_started);
+  unordered_map<pid_t, size_t> job_by_pid;
+  vector<int> free_slots;
+  for(int slot = max_jobs - 1; slot >= 0; --slot) free_slots.push_back(slot);
+
+  // all running jobs share a process group, so one waitpid(-pgid) waits for
+  // whichever ends first without reaping background jobs of smash. That
+  // group is the foreground job: ctrl-C kills the running jobs and starts
+  // no more, ctrl-Z stops them as one job of smash and ends parallel.
+  // A pipeline that runs parallel as a built-in stage is the foreground
+  // job again afterwards.
+  pid_t outer_fg_pid = smash.curr_fg_pid;
+  string outer_fg_cmd = smash.curr_fg_cmd;
+  pid_t pgid = 0;
+  int running = 0;
+  int failed = 0;
+  size_t next_input = 0;
+  size_t next_output = 0;
+  bool stopped = false;
+  cout.flush();
+
+  while(next_output < num_jobs && !stopped) {
+    if(pgid > 0 && smash.curr_fg_pid != pgid) { // interrupted: skip the inputs not started yet
+      for(; next_input < num_jobs; ++next_input) jobs[next_input].done = true;
+    }
+    while(running < max_jobs && next_input < num_jobs) {
+      Job& job = jobs[next_input];
+      job.slot = free_slots.back();
+      job.done = false;
+      if(!startJob(next_input++, job, running > 0 ? pgid : 0, cpus)) {
+        job.done = true;
+        ++failed;
+        continue;
+      }
+      if(running == 0) {
+        pgid = job.pid;
+        smash.curr_fg_pid = pgid;
+        smash.curr_fg_cmd = cmd;
+      }
+      free_slots.pop_back();
+      job_by_pid[job.pid] = next_input - 1;
+      ++running;
+    }
+
+    for(; next_output < num_jobs && jobs[next_output].done; ++next_output) {
+      int output_fd = jobs[next_output].output_fd;
+      if(output_fd < 0) continue;
+      if(lseek(output_fd, 0, SEEK_SET) < 0 || DataPump::pump(output_fd, STDOUT_FILENO) < 0) {
+        perror("smash error: parallel output failed");
+      }
+      close(output_fd);
+    }
+    if(running == 0) continue;
+
+    int status;
+    struct rusage usage;
+    pid_t pid = smash.waitChild(-pgid, &status, WUNTRACED, &usage);
+    if(pid < 0) {
+      perror("smash error: waitpid failed");
+      break;
+    }
+    if(WIFSTOPPED(status)) {
+      stopped = true;
+      if(smash.jobs.getJobByPid(pgid) == nullptr) smash.jobs.addJob(cmd, pgid, true);
+      break;
+    }
+    auto it = job_by_pid.find(pid);
+    if(it == job_by_pid.end()) continue;
+    Job& job = jobs[it->second];
+    job_by_pid.erase(it);
+    _addUsage(&smash.fg_usage, usage);
+    job.done = true;
+    free_slots.push_back(job.slot);
+    --running;
+    if(_exitStatus(status) != 0) ++failed;
+  }
+
+  // only reached early if stopped or if waiting failed, don't leak the
+  // remaining outputs (the output of stopped jobs is lost)
+  for(; next_output < num_jobs; ++next_output) {
+    if(jobs[next_output].output_fd >= 0) close(jobs[next_output].output_fd);
+  }
+  smash.curr_fg_pid = outer_fg_pid;
+  smash.curr_fg_cmd = outer_fg_cmd;
+  smash.last_status = stopped ? 128 + SIGSTOP : failed > 100 ? 101 : failed;
+}
+
+// ========================= Time Command ======================== //
+TimeCommand::TimeCommand(CommandLine* line) : BuiltInCommand(line) {}
+
+void _printDuration(const char* label, double seconds) {
+  long minutes = seconds / 60;
+  cerr << label << "\t" << minutes << "m" << fixed << setprecision(3) << seconds - minutes * 60 << "s\n";
+  cerr.unsetf(ios::floatfield);
+}
+
+void TimeCommand::execute() {
+  SmallShell& smash = SmallShell::getInstance();
+  if(line->num_tokens < 2 || line->tokens[1].type != SMASH_TOKEN_WORD) {
+    cerr << "smash error: time: invalid arguments\n";
+    return;
+  }
+
+  Command* timed_cmd = smash.CreateCommand(new CommandLine(*line, 1, line->num_tokens));
+  timed_cmd->cmd = cmd;
+
+  // children are accounted by the waits of the command (fg_usage),
+  // work smash does itself (built-ins, launching) by its own usage
+  struct rusage self_before, self_after;
+  struct timespec start, end;
+  memset(&smash.fg_usage, 0, sizeof(smash.fg_usage));
+  getrusage(RUSAGE_SELF, &self_before);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  timed_cmd->execute();
+  delete timed_cmd;
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  getrusage(RUSAGE_SELF, &self_after);
+  struct rusage total = smash.fg_usage;
+  timersub(&self_after.ru_utime, &self_before.ru_utime, &self_after.ru_utime);
+  timersub(&self_after.ru_stime, &self_before.ru_stime, &self_after.ru_stime);
+  timeradd(&total.ru_utime, &self_after.ru_utime, &total.ru_utime);
+  timeradd(&total.ru_stime, &self_after.ru_stime, &total.ru_stime);
+
+  cout.flush();
+  _printDuration("real", (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+  _printDuration("user", total.ru_utime.tv_sec + total.ru_utime.tv_usec / 1e6);
+  _printDuration("sys", total.ru_stime.tv_sec + total.ru_stime.tv_usec / 1e6);
+  cerr << "maxrss\t" << total.ru_maxrss << "KB\n"
+       << "faults\t" << total.ru_majflt << " major, " << total.ru_minflt << " minor\n"
+       << "ctxsw\t" << total.ru_nvcsw << " voluntary, " << total.ru_nivcsw << " involuntary\n";
+}
+
+// ========================= Profiler ======================== //
+const unsigned long Profiler::RING_SIZE;
+const char* PHASE_NAMES[SMASH_NUM_PHASES] = { "command", "parse", "create", "reap", "spawn", "wait" };
+
+// SMASH_TRACE (any value but 0) turns the profiler on, SMASH_TRACE_FILE
+// also turns it on and names the file the trace is written to at exit
+Profiler::Profiler() : next_span(0), enabled(false), owner_pid(getpid()) {
+  const char* trace_env = getenv("SMASH_TRACE");
+  const char* file_env = getenv("SMASH_TRACE_FILE");
+  if(trace_env && *trace_env && strcmp(trace_env, "0") != 0) enabled = true;
+  if(file_env && *file_env) {
+    enabled = true;
+    trace_file = file_env;
+  }
+}
+
+Profiler::~Profiler() {
+  if(trace_file.empty() || getpid() != owner_pid) return;
+  ofstream out(trace_file.c_str());
+  if(!out) {
+    perror("smash error: open failed");
+    return;
+  }
+  writeChromeTrace(out);
+}
+
+void Profiler::reset() {
+  next_span.store(0, memory_order_relaxed);
+}
+
+void Profiler::printSummary(ostream& out) const {
+  unsigned long total = next_span.load(memory_order_relaxed);
+  unsigned long count = min(total, RING_SIZE);
+  vector<long> durations[SMASH_NUM_PHASES];
+  for(unsigned long i = total - count; i < total; ++i) {
+    const Span& span = ring[i & (RING_SIZE - 1)];
+    durations[span.phase].push_back(span.end_ns - span.begin_ns);
+  }
+
+  out << "smash: profiler " << (enabled ? "on" : "off") << ", " << count << " of " << total << " spans kept\n";
+  out << left << setw(8) << "phase" << right << setw(8) << "count" << setw(12) << "mean(us)"
+      << setw(12) << "p50(us)" << setw(12) << "p99(us)" << setw(12) << "max(us)" << "\n";
+  out << fixed << setprecision(1);
+  for(int phase = 0; phase < SMASH_NUM_PHASES; ++phase) {
+    vector<long>& phase_durations = durations[phase];
+    if(phase_durations.empty()) continue;
+    sort(phase_durations.begin(), phase_durations.end());
+    size_t n = phase_durations.size();
+    long sum = 0;
+    for(size_t i = 0; i < n; ++i) sum += phase_durations[i];
+    out << left << setw(8) << PHASE_NAMES[phase] << right << setw(8) << n
+        << setw(12) << sum / 1000.0 / n
+        << setw(12) << phase_durations[n / 2] / 1000.0
+        << setw(12) << phase_durations[min(n - 1, n * 99 / 100)] / 1000.0
+        << setw(12) << phase_durations[n - 1] / 1000.0 << "\n";
+  }
+  out.unsetf(ios::floatfield | ios::adjustfield);
+}
+
+// Chrome trace event format: complete ("X") events, timestamps in microseconds
+void Profiler::writeChromeTrace(ostream& out) const {
+  unsigned long total = next_span.load(memory_order_relaxed);
+  unsigned long count = min(total, RING_SIZE);
+  out << "{\"traceEvents\":[";
+  out << fixed << setprecision(3);
+  for(unsigned long i = total - count; i < total; ++i) {
+    const Span& span = ring[i & (RING_SIZE - 1)];
+    if(i != total - count) out << ",";
+    out << "\n{\"name\":\"" << PHASE_NAMES[span.phase] << "\",\"ph\":\"X\",\"pid\":" << owner_pid
+        << ",\"tid\":" << owner_pid << ",\"ts\":" << span.begin_ns / 1000.0
+        << ",\"dur\":" << (span.end_ns - span.begin_ns) / 1000.0 << "}";
+  }
+  out.unsetf(ios::floatfield);
+  out << "\n],\"displayTimeUnit\":\"ns\"}\n";
+}
+
+SmashStatCommand::SmashStatCommand(CommandLine* line) : BuiltInCommand(line) {}
+
+void SmashStatCommand::execute() {
+  Profiler& profiler = SmallShell::getInstance().profiler;
+  const char* action = argc > 1 ? argv[1] : "summary";
+  if(argc > 2) {
+    cerr << "smash error: smashstat: invalid arguments\n";
+  } else if(strcmp(action, "on") == 0) {
+    profiler.enabled = true;
+  } else if(strcmp(action, "off") == 0) {
+    profiler.enabled = false;
+  } else if(strcmp(action, "reset") == 0) {
+    profiler.reset();
+  } else if(strcmp(action, "summary") == 0) {
+    profiler.printSummary(cout);
+    const ResultCache& cache = SmallShell::getInstance().result_cache;
+    if(cache.hits + cache.misses > 0) cache.printStats(cout);
+  } else if(strcmp(action, "dump") == 0) {
+    profiler.writeChromeTrace(cout);
+  } else {
+    cerr << "smash error: smashstat: invalid arguments\n";
+  }
+}
+
+// ========================= History ======================== //
+History::History() :
+  log_fd(-1),
+  index_fd(-1),
+  log_map(nullptr),
+  log_map_size(0),
+  index_map(nullptr),
+  index_map_size(0),
+  prefix_indexed(0) {}
+
+History::~History() {
+  if(log_map) munmap((void*)log_map, log_map_size);
+  if(index_map) munmap((void*)index_map, index_map_size);
+  if(log_fd >= 0) close(log_fd);
+  if(index_fd >= 0) close(index_fd);
+}
+
+bool History::isOpen() const {
+  return log_fd >= 0 && index_fd >= 0;
+}
+
+// opens (creating if needed) the history files, nothing is read yet
+bool History::open() {
+  if(isOpen()) return true;
+  const char* path_env = getenv("SMASH_HISTFILE");
+  const char* home = getenv("HOME");
+  if(path_env && *path_env) log_path = path_env;
+  else if(home && *home) log_path = string(home) + "/.smash_history";
+  else return false;
+
+  log_fd = _moveAboveUserFds(::open(log_path.c_str(), O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600));
+  index_fd = _moveAboveUserFds(::open((log_path + ".idx").c_str(), O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600));
+  if(log_fd < 0 || index_fd < 0) {
+    perror("smash error: open failed");
+    if(log_fd >= 0) close(log_fd);
+    if(index_fd >= 0) close(index_fd);
+    log_fd = index_fd = -1;
+    return false;
+  }
+  return true;
+}
+
+void History::add(const string& cmd_line) {
+  if(!isOpen() || cmd_line.find_first_not_of(" \t") == string::npos) return;
+  while(flock(log_fd, LOCK_EX) < 0) {
+    if(errno != EINTR) {
+      perror("smash error: flock failed");
+      return;
+    }
+  }
+  // the log is written first: an index record always points at a whole line
+  struct stat log_stat;
+  if(fstat(log_fd, &log_stat) == 0) {
+    string log_line = cmd_line + "\n";
+    IndexRecord record = { (int64_t)log_stat.st_size, (int64_t)time(nullptr) };
+    if(write(log_fd, log_line.c_str(), log_line.length()) != (ssize_t)log_line.length() ||
+       write(index_fd, &record, sizeof(record)) != sizeof(record)) {
+      perror("smash error: write failed");
+    }
+  }
+  flock(log_fd, LOCK_UN);
+}
+
+// maps the files again if other entries were appended since the last call
+bool History::remap() {
+  struct stat index_stat, log_stat;
+  // index before log: every entry of the index seen here is in the log seen below
+  if(fstat(index_fd, &index_stat) < 0 || fstat(log_fd, &log_stat) < 0) {
+    return false;
+  }
+  size_t index_size = index_stat.st_size - index_stat.st_size % sizeof(IndexRecord);
+  if(index_size != index_map_size) {
+    if(index_map) munmap((void*)index_map, index_map_size);
+    index_map = nullptr;
+    index_map_size = 0;
+    if(index_size > 0) {
+      void* mapped = mmap(nullptr, index_size, PROT_READ, MAP_SHARED, index_fd, 0);
+      if(mapped == MAP_FAILED) {
+        perror("smash error: mmap failed");
+        return false;
+      }
+      index_map = (const IndexRecord*)mapped;
+      index_map_size = index_size;
+    }
+  }
+  if((size_t)log_stat.st_size != log_map_size) {
+    if(log_map) munmap((void*)log_map, log_map_size);
+    log_map = nullptr;
+    log_map_size = 0;
+    if(log_stat.st_size > 0) {
+      void* mapped = mmap(nullptr, log_stat.st_size, PROT_READ, MAP_SHARED, log_fd, 0);
+      if(mapped == MAP_FAILED) {
+        perror("smash error: mmap failed");
+        return false;
+      }
+      log_map = (const char*)mapped;
+      log_map_size = log_stat.st_size;
+    }
+  }
+  return true;
+}
+
+long History::size() {
+  if(!isOpen() || !remap()) return 0;
+  return index_map_size / sizeof(IndexRecord);
+}
+
+// entry n, valid for 1 <= n <= size()
+string History::entry(long n) {
+  size_t offset = index_map[n - 1].offset;
+  if(offset >= log_map_size) return "";
+  const char* begin = log_map + offset;
+  const char* end = (const char*)memchr(begin, '\n', log_map_size - offset);
+  return string(begin, end ? end - begin : log_map_size - offset);
+}
+
+time_t History::entryTime(long n) {
+  return index_map[n - 1].time;
+}
+
+// child of node whose label starts with c, -1 if there is none
+int History::prefixChild(int node, char c) const {
+  const vector<pair<char, int>>& children = prefix_nodes[node].children;
+  auto it = lower_bound(children.begin(), children.end(), make_pair(c, 0));
+  return it != children.end() && it->first == c ? it->second : -1;
+}
+
+// adds entry n (newer than every entry indexed so far) under command,
+// splitting the edge where command leaves it
+void History::indexPrefix(const string& command, long n) {
+  int node = 0;
+  size_t pos = 0;
+  prefix_nodes[0].latest = n;
+  while(pos < command.length()) {
+    int child = prefixChild(node, command[pos]);
+    if(child < 0) {
+      PrefixNode leaf = {command.substr(pos), vector<pair<char, int>>(), n};
+      prefix_nodes.push_back(leaf);
+      vector<pair<char, int>>& children = prefix_nodes[node].children;
+      pair<char, int> edge = make_pair(command[pos], (int)prefix_nodes.size() - 1);
+      children.insert(lower_bound(children.begin(), children.end(), edge), edge);
+      return;
+    }
+    const string& label = prefix_nodes[child].label;
+    size_t common = 0;
+    while(common < label.length() && pos + common < command.length() && label[common] == command[pos + common]) {
+      ++common;
+    }
+    if(common < label.length()) { // a new node takes the common part of the edge
+      PrefixNode middle = {label.substr(0, common), vector<pair<char, int>>(1, make_pair(label[common], child)), n};
+      prefix_nodes[child].label.erase(0, common);
+      prefix_nodes.push_back(middle);
+      child = prefix_nodes.size() - 1;
+      vector<pair<char, int>>& children = prefix_nodes[node].children;
+      lower_bound(children.begin(), children.end(), make_pair(command[pos], 0))->second = child;
+    }
+    prefix_nodes[child].latest = n;
+    node = child;
+    pos += common;
+  }
+}
+
+// latest entry starting with prefix, 0 if there is none
+long History::findPrefix(const string& prefix) {
+  long count = size();
+  if(prefix_nodes.empty()) {
+    PrefixNode root = {"", vector<pair<char, int>>(), 0};
+    prefix_nodes.push_back(root);
+  }
+  for(; prefix_indexed < count; ++prefix_indexed) {
+    indexPrefix(entry(prefix_indexed + 1), prefix_indexed + 1);
+  }
+
+  int node = 0;
+  size_t pos = 0;
+  while(pos < prefix.length()) {
+    if((node = prefixChild(node, prefix[pos])) < 0) return 0;
+    const string& label = prefix_nodes[node].label;
+    size_t len = min(label.length(), prefix.length() - pos);
+    if(label.compare(0, len, prefix, pos, len) != 0) return 0;
+    pos += len;
+  }
+  return prefix_nodes[node].latest;
+}
+
+// first entry entered at or after time (binary search over the index), size() + 1 if none
+long History::findTime(time_t time) {
+  long count = size();
+  long low = 0, high = count;
+  while(low < high) {
+    long mid = low + (high - low) / 2;
+    if(index_map[mid].time < time) low = mid + 1;
+    else high = mid;
+  }
+  return low + 1;
+}
+
+/**
+* Replaces a "!!", "!n" or "!prefix" line with the entry it recalls and
+* echoes it, like bash. Returns false (after printing an error) if there
+* is no such entry.
+*/
+bool History::expand(string& cmd_line) {
+  size_t start = cmd_line.find_first_not_of(" \t");
+  if(start == string::npos || cmd_line[start] != '!' || start + 1 >= cmd_line.length()) {
+    return true;
+  }
+  size_t end = cmd_line.find_last_not_of(" \t") + 1;
+  string event = cmd_line.substr(start + 1, end - start - 1);
+
+  long n = 0;
+  long count = size();
+  if(event == "!") {
+    n = count;
+  } else if(event.find_first_not_of("0123456789") == string::npos) {
+    n = atol(event.c_str());
+  } else {
+    n = findPrefix(event);
+  }
+  if(n < 1 || n > count) {
+    cerr << "smash error: !" << event << ": event not found\n";
+    return false;
+  }
+  cmd_line = entry(n);
+  cout << cmd_line << "\n";
+  return true;
+}
+
+HistoryCommand::HistoryCommand(CommandLine* line) : BuiltInCommand(line) {}
+
+void HistoryCommand::execute() {
+  History& history = SmallShell::getInstance().history;
+  long last = -1;  // history <count>
+  long since = -1; // history -s <unix-time>
+  try {
+    size_t parsed_len;
+    if(argc == 2) {
+      last = stol(argv[1], &parsed_len);
+      if(parsed_len != strlen(argv[1]) || last < 0) throw invalid_argument(argv[1]);
+    } else if(argc == 3 && strcmp(argv[1], "-s") == 0) {
+      since = stol(argv[2], &parsed_len);
+      if(parsed_len != strlen(argv[2]) || since < 0) throw invalid_argument(argv[2]);
+    } else if(argc != 1) {
+      throw invalid_argument(argv[1]);
+    }
+  } catch(const exception& e) {
+    cerr << "smash error: history: invalid arguments\n";
+    return;
+  }
+
+  if(!history.open()) {
+    cerr << "smash error: history: no history file\n";
+    return;
+  }
+  long count = history.size();
+  long first = 1;
+  if(last >= 0) first = max(1L, count - last + 1);
+  if(since >= 0) first = history.findTime(since);
+
+  for(long n = first; n <= count; ++n) {
+    cout << setw(5) << n << "  ";
+    if(since >= 0) {
+      time_t entry_time = history.entryTime(n);
+      char time_str[32];
+      strftime(time_str, sizeof(time_str), "%F %T", localtime(&entry_time));
+      cout << time_str << "  ";
+    }
+    cout << history.entry(n) << "\n";
+  }
+}
+
+// ========================= Result Cache ======================== //
+const size_t ResultCache::MAX_ENTRIES;
+const size_t ResultCache::MAX_BYTES;
+const size_t ResultCache::MAX_ENTRY_BYTES;
+
+long _realtimeMs() {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return now.tv_sec * 1000L + now.tv_nsec / 1000000;
+}
+
+// reads all of fd from offset 0 into data
+bool _readFile(int fd, string* data) {
+  char buf[1 << 16];
+  data->clear();
+  for(off_t offset = 0; ; ) {
+    ssize_t bytes_read = pread(fd, buf, sizeof(buf), offset);
+    if(bytes_read < 0 && errno == EINTR) continue;
+    if(bytes_read < 0) return false;
+    if(bytes_read == 0) return true;
+    data->append(buf, bytes_read);
+    offset += bytes_read;
+  }
+}
+
+// SMASH_CACHE_DIR names the directory entries are spilled to, created if needed
+ResultCache::ResultCache() : bytes(0), hits(0), disk_hits(0), misses(0), saved_us(0) {
+  const char* dir_env = getenv("SMASH_CACHE_DIR");
+  if(dir_env && *dir_env) {
+    spill_dir = dir_env;
+    if(mkdir(dir_env, 0700) < 0 && errno != EEXIST) {
+      perror("smash error: mkdir failed");
+      spill_dir.clear();
+    }
+  }
+}
+
+/**
+* Returns the live entry for key, from memory or else from the spill
+* directory, or null on a miss. The entry stays valid until the next call.
+*/
+const ResultCache::Entry* ResultCache::lookup(const string& key) {
+  auto found = index.find(key);
+  if(found != index.end() && found->second->expires_ms <= _realtimeMs()) {
+    erase(found->second);
+    found = index.end();
+  }
+  if(found == index.end()) {
+    Entry spilled;
+    if(!readSpilled(key, &spilled)) {
+      ++misses;
+      return nullptr;
+    }
+    insert(spilled);
+    found = index.find(key);
+    ++disk_hits;
+  } else {
+    entries.splice(entries.begin(), entries, found->second);
+  }
+  ++hits;
+  saved_us += found->second->run_us;
+  return &*found->second;
+}
+
+void ResultCache::store(const Entry& entry) {
+  if(entry.out.size() + entry.err.size() > MAX_ENTRY_BYTES) return;
+  insert(entry);
+  if(!spill_dir.empty()) spill(entry);
+}
+
+void ResultCache::clear() {
+  entries.clear();
+  index.clear();
+  bytes = 0;
+  if(spill_dir.empty()) return;
+  DIR* dir = opendir(spill_dir.c_str());
+  if(dir == nullptr) {
+    perror("smash error: opendir failed");
+    return;
+  }
+  for(struct dirent* dir_entry; (dir_entry = readdir(dir)) != nullptr; ) {
+    if(strncmp(dir_entry->d_name, "smash-", 6) == 0) {
+      unlinkat(dirfd(dir), dir_entry->d_name, 0);
+    }
+  }
+  closedir(dir);
+}
+
+void ResultCache::printStats(ostream& out) const {
+  out << "cached: " << entries.size() << " entries, " << bytes << " bytes, "
+      << hits << " hits (" << disk_hits << " from disk), " << misses << " misses, "
+      << fixed << setprecision(3) << saved_us / 1e6 << "s saved\n";
+  out.unsetf(ios::floatfield);
+}
+
+// puts entry first, replacing an entry with the same key, and evicts from
+// the back until the cache is within its limits
+void ResultCache::insert(const Entry& entry) {
+  auto found = index.find(entry.key);
+  if(found != index.end()) erase(found->second);
+  entries.push_front(entry);
+  index[entry.key] = entries.begin();
+  bytes += entry.key.size() + entry.out.size() + entry.err.size();
+  while(entries.size() > MAX_ENTRIES || (bytes > MAX_BYTES && entries.size() > 1)) {
+    erase(--entries.end());
+  }
+}
+
+void ResultCache::erase(list<Entry>::iterator it) {
+  bytes -= it->key.size() + it->out.size() + it->err.size();
+  index.erase(it->key);
+  entries.erase(it);
+}
+
+string ResultCache::spillPath(const string& key) const {
+  ostringstream path;
+  path << spill_dir << "/smash-" << hex << setw(16) << setfill('0') << std::hash<string>()(key);
+  return path.str();
+}
+
+// A spilled entry is a header line followed by the key, stdout and stderr:
+// "smash-cache 1 <key len> <out len> <err len> <status> <run us> <expires ms>\n"
+bool ResultCache::readSpilled(const string& key, Entry* entry) const {
+  if(spill_dir.empty()) return false;
+  int fd = ::open(spillPath(key).c_str(), O_RDONLY | O_CLOEXEC);
+  if(fd < 0) return false;
+  string data;
+  bool read_ok = _readFile(fd, &data);
+  close(fd);
+
+  size_t key_len, out_len, err_len;
+  int header_len = 0;
+  if(!read_ok || sscanf(data.c_str(), "smash-cache 1 %zu %zu %zu %d %ld %ld\n%n", &key_len, &out_len, &err_len,
+                        &entry->status, &entry->run_us, &entry->expires_ms, &header_len) != 6 ||
+     header_len == 0 || data.size() != header_len + key_len + out_len + err_len) {
+    return false;
+  }
+  // different keys can share a file name, the stored key tells them apart
+  if(data.compare(header_len, key_len, key) != 0 || entry->expires_ms <= _realtimeMs()) return false;
+  entry->key = key;
+  entry->out = data.substr(header_len + key_len, out_len);
+  entry->err = data.substr(header_len + key_len + out_len, err_len);
+  return true;
+}
+
+// written to a temporary file and renamed, so a concurrent smash never reads half an entry
+void ResultCache::spill(const Entry& entry) const {
+  string path = spillPath(entry.key);
+  string tmp_path = path + ".tmp" + to_string(getpid());
+  ostringstream header;
+  header << "smash-cache 1 " << entry.key.size() << " " << entry.out.size() << " " << entry.err.size()
+         << " " << entry.status << " " << entry.run_us << " " << entry.expires_ms << "\n";
+  string data = header.str() + entry.key + entry.out + entry.err;
+
+  int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if(fd < 0) {
+    perror("smash error: open failed");
+    return;
+  }
+  bool written = _writeAll(fd, data.data(), data.size());
+  close(fd);
+  if(!written || rename(tmp_path.c_str(), path.c_str()) < 0) {
+    perror("smash error: write failed");
+    unlink(tmp_path.c_str());
+  }
+}
+
+// ========================= Cached Command ======================== //
+CachedCommand::CachedCommand(CommandLine* line) : BuiltInCommand(line) {}
+
+// appends what identifies the current content of the file path names
+void _appendFileState(string* key, const char* path) {
+  struct stat path_stat;
+  *key += '\0';
+  *key += path;
+  if(stat(path, &path_stat) < 0) return;
+  *key += " " + to_string(path_stat.st_ino) + " " + to_string(path_stat.st_size) + " " +
+          to_string(path_stat.st_mtim.tv_sec) + "." + to_string(path_stat.st_mtim.tv_nsec);
+}
+
+void CachedCommand::execute() {
+  SmallShell& smash = SmallShell::getInstance();
+  ResultCache& cache = smash.result_cache;
+  if(argc == 2 && strcmp(argv[1], "-s") == 0) {
+    cache.printStats(cout);
+    return;
+  }
+  if(argc == 2 && strcmp(argv[1], "-c") == 0) {
+    cache.clear();
+    return;
+  }
+
+  // cached <ttl> <command>: the command is every token after the ttl
+  if(argc < 3 || line->num_tokens < 3 || line->tokens[2].type != SMASH_TOKEN_WORD) {
+    cerr << "smash error: cached: invalid arguments\n";
+    return;
+  }
+  int ttl;
+  try {
+    size_t parsed_len;
+    ttl = stoi(argv[1], &parsed_len);
+    if(parsed_len != strlen(argv[1]) || ttl < 0) throw invalid_argument(argv[1]);
+  } catch(const exception& e) {
+    cerr << "smash error: cached: invalid arguments\n";
+    return;
+  }
+  CommandLine* cached_line = new CommandLine(*line, 2, line->num_tokens);
+  if(cached_line->is_background) {
+    cerr << "smash error: cached: invalid arguments\n";
+    delete cached_line;
+    return;
+  }
+
+  // the key: the command, the cwd, and the state of the cwd and of every
+  // argument that names a file (the program itself only if given as a path)
+  string key = cached_line->text(0, cached_line->num_tokens);
+  char* cwd = getcwd(nullptr, 0);
+  if(cwd != nullptr) {
+    key += '\0';
+    key += cwd;
+    free(cwd);
+  }
+  _appendFileState(&key, ".");
+  Command* cached_cmd = smash.CreateCommand(cached_line);
+  for(int i = 0; i < cached_cmd->argc; ++i) {
+    if(i > 0 || strchr(cached_cmd->argv[i], '/') != nullptr) _appendFileState(&key, cached_cmd->argv[i]);
+  }
+
+  const ResultCache::Entry* hit = cache.lookup(key);
+  if(hit != nullptr) {
+    cout.flush();
+    _writeAll(STDOUT_FILENO, hit->out.data(), hit->out.size());
+    _writeAll(STDERR_FILENO, hit->err.data(), hit->err.size());
+    smash.last_status = hit->status;
+    delete cached_cmd;
+    return;
+  }
+
+  // a miss runs the command with stdout and stderr in memfds, then replays
+  // them; stdin is /dev/null, since the input is not part of the key
+  ResultCache::Entry entry;
+  entry.key = key;
+  int in_fd = _moveAboveUserFds(::open("/dev/null", O_RDONLY | O_CLOEXEC));
+  int out_fd = _moveAboveUserFds(memfd_create("smash-cached-out", MFD_CLOEXEC));
+  int err_fd = _moveAboveUserFds(memfd_create("smash-cached-err", MFD_CLOEXEC));
+  vector<LaunchSpec::FdAction> fd_actions;
+  vector<pair<int, int>> saved_fds;
+  if(in_fd < 0 || out_fd < 0 || err_fd < 0) {
+    perror("smash error: memfd_create failed");
+  } else {
+    fd_actions.push_back(LaunchSpec::dupAction(in_fd, 0));
+    fd_actions.push_back(LaunchSpec::dupAction(out_fd, 1));
+    fd_actions.push_back(LaunchSpec::dupAction(err_fd, 2));
+  }
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  cout.flush();
+  bool redirected = !fd_actions.empty() && _redirectInProcess(fd_actions, &saved_fds);
+  cached_cmd->execute();
+  cout.flush();
+  _restoreFds(saved_fds);
+  cout.clear();
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  delete cached_cmd;
+
+  entry.status = smash.last_status;
+  entry.run_us = (end.tv_sec - start.tv_sec) * 1000000L + (end.tv_nsec - start.tv_nsec) / 1000;
+  entry.expires_ms = _realtimeMs() + ttl * 1000L;
+  if(redirected && _readFile(out_fd, &entry.out) && _readFile(err_fd, &entry.err)) {
+    _writeAll(STDOUT_FILENO, entry.out.data(), entry.out.size());
+    _writeAll(STDERR_FILENO, entry.err.data(), entry.err.size());
+    // killed or stopped commands left no result worth replaying
+    if(entry.status < 128) cache.store(entry);
+  }
+  if(in_fd >= 0) close(in_fd);
+  if(out_fd >= 0) close(out_fd);
+  if(err_fd >= 0) close(err_fd);
+}
+
+// ========================= Executable Trie ======================== //
+ExecutableTrie::ExecutableTrie() {
+  Node root;
+  root.is_name = false;
+  nodes.push_back(root);
+}
+
+void ExecutableTrie::insert(const char* name) {
+  int node = 0;
+  for(const char* p = name; *p; ++p) {
+    vector<pair<char, int>>& children = nodes[node].children;
+    auto it = lower_bound(children.begin(), children.end(), make_pair(*p, 0));
+    if(it != children.end() && it->first == *p) {
+      node = it->second;
+      continue;
+    }
+    int child = nodes.size();
+    children.insert(it, make_pair(*p, child));
+    Node new_node; // may move nodes, children isn't used after this
+    new_node.is_name = false;
+    nodes.push_back(new_node);
+    node = child;
+  }
+  nodes[node].is_name = true;
+}
+
+// Rebuilds the trie if PATH changed or a directory of it was modified since
+// the last build. Checking costs one stat per PATH directory.
+void ExecutableTrie::refresh() {
+  const char* path = getenv("PATH");
+  string curr_path = path ? path : "";
+  bool stale = curr_path != path_env || dirs.empty();
+  for(auto it = dirs.begin(); !stale && it != dirs.end(); ++it) {
+    struct stat dir_stat;
+    stale = stat(it->path.c_str(), &dir_stat) < 0 ||
+            dir_stat.st_mtim.tv_sec != it->mtime.tv_sec || dir_stat.st_mtim.tv_nsec != it->mtime.tv_nsec;
+  }
+  if(!stale) return;
+
+  nodes.resize(1);
+  nodes[0].children.clear();
+  nodes[0].is_name = false;
+  dirs.clear();
+  path_env = curr_path;
+
+  size_t start = 0;
+  while(start <= curr_path.length()) {
+    size_t end = curr_path.find(':', start);
+    if(end == string::npos) end = curr_path.length();
+    string dir_path = curr_path.substr(start, end - start);
+    start = end + 1;
+    if(dir_path.empty() || dir_path[0] != '/') continue; // relative entries depend on the cwd
+
+    DIR* dir = opendir(dir_path.c_str());
+    if(dir == nullptr) continue;
+    // mtime taken before reading, a change while reading triggers another rebuild
+    PathDir path_dir;
+    path_dir.path = dir_path;
+    struct stat dir_stat;
+    if(fstat(dirfd(dir), &dir_stat) < 0) {
+      closedir(dir);
+      continue;
+    }
+    path_dir.mtime = dir_stat.st_mtim;
+    dirs.push_back(path_dir);
+
+    struct dirent* entry;
+    while((entry = readdir(dir)) != nullptr) {
+      if(entry->d_name[0] == '.' || entry->d_type == DT_DIR) continue;
+      if(faccessat(dirfd(dir), entry->d_name, X_OK, 0) == 0) {
+        insert(entry->d_name);
+      }
+    }
+    closedir(dir);
+  }
+}
+
+// node reached by prefix, -1 if no name starts with it
+int ExecutableTrie::find(const string& prefix) const {
+  int node = 0;
+  for(size_t i = 0; i < prefix.length(); ++i) {
+    const vector<pair<char, int>>& children = nodes[node].children;
+    auto it = lower_bound(children.begin(), children.end(), make_pair(prefix[i], 0));
+    if(it == children.end() || it->first != prefix[i]) return -1;
+    node = it->second;
+  }
+  return node;
+}
+
+// longest common prefix of all names starting with prefix
+string ExecutableTrie::extend(const string& prefix) const {
+  int node = find(prefix);
+  string extended = prefix;
+  while(node >= 0 && !nodes[node].is_name && nodes[node].children.size() == 1) {
+    extended += nodes[node].children[0].first;
+    node = nodes[node].children[0].second;
+  }
+  return extended;
+}
+
+void _collectNames(const vector<ExecutableTrie::Node>& nodes, int node, string& name,
+                   vector<string>* names, size_t limit) {
+  if(names->size() >= limit) return;
+  if(nodes[node].is_name) names->push_back(name);
+  for(auto it = nodes[node].children.begin(); it != nodes[node].children.end(); ++it) {
+    name += it->first;
+    _collectNames(nodes, it->second, name, names, limit);
+    name.erase(name.length() - 1);
+  }
+}
+
+// the first (in sorted order) limit names starting with prefix
+void ExecutableTrie::collect(const string& prefix, vector<string>* names, size_t limit) const {
+  int node = find(prefix);
+  if(node < 0) return;
+  string name = prefix;
+  _collectNames(nodes, node, name, names, limit);
+}
+
+// ========================= Line Editor ======================== //
+LineEditor::LineEditor() :
+  cursor(0),
+  key_state(SMASH_KEY_NORMAL),
+  is_raw(false),
+  history_pos(0) {}
+
+LineEditor::~LineEditor() {
+  end();
+}
+
+// starts editing a new line: raw mode on, prompt shown
+bool LineEditor::begin(const string& new_prompt) {
+  prompt = new_prompt;
+  buffer.clear();
+  cursor = 0;
+  key_state = SMASH_KEY_NORMAL;
+  history_pos = 0;
+  edited_line.clear();
+
+  if(!is_raw) {
+    if(tcgetattr(STDIN_FILENO, &saved_termios) < 0) {
+      return false;
+    }
+    struct termios raw_termios = saved_termios;
+    raw_termios.c_lflag &= ~(ICANON | ECHO | IEXTEN);
+    raw_termios.c_iflag &= ~(IXON | ICRNL);
+    raw_termios.c_cc[VMIN] = 1;
+    raw_termios.c_cc[VTIME] = 0;
+    if(tcsetattr(STDIN_FILENO, TCSADRAIN, &raw_termios) < 0) {
+      perror("smash error: tcsetattr failed");
+      return false;
+    }
+    is_raw = true;
+  }
+  cout.flush();
+  output(prompt);
+  return true;
+}
+
+// gives the terminal back in the mode it was in before begin()
+void LineEditor::end() {
+  if(is_raw) {
+    if(tcsetattr(STDIN_FILENO, TCSADRAIN, &saved_termios) < 0) {
+      perror("smash error: tcsetattr failed");
+    }
+    is_raw = false;
+  }
+}
+
+/**
+* Processes one input byte. Returns SMASH_EDIT_LINE with the finished line
+* in *line, SMASH_EDIT_EOF on ctrl-D at an empty line (the terminal is
+* restored in both cases), or SMASH_EDIT_MORE.
+*/
+edit_result_t LineEditor::feed(char c, string* line) {
+  if(key_state != SMASH_KEY_NORMAL) {
+    feedEscape(c);
+    if(key_state == SMASH_KEY_NORMAL) redraw(); // sequence complete
+    return SMASH_EDIT_MORE;
+  }
+  return feedKey(c, line);
+}
+
+edit_result_t LineEditor::feedKey(char c, string* line) {
+  switch(c) {
+    case '\r':
+    case '\n':
+      *line = buffer;
+      output("\n");
+      end();
+      return SMASH_EDIT_LINE;
+    case 4: // ctrl-D
+      if(buffer.empty()) {
+        output("\n");
+        end();
+        return SMASH_EDIT_EOF;
+      }
+      if(cursor < buffer.length()) erase(cursor, cursor + 1);
+      break;
+    case 127: // backspace
+    case 8:
+      if(cursor > 0) erase(cursor - 1, cursor);
+      break;
+    case 1: // ctrl-A
+      cursor = 0;
+      break;
+    case 5: // ctrl-E
+      cursor = buffer.length();
+      break;
+    case 2: // ctrl-B
+      if(cursor > 0) --cursor;
+      break;
+    case 6: // ctrl-F
+      if(cursor < buffer.length()) ++cursor;
+      break;
+    case 11: // ctrl-K
+      erase(cursor, buffer.length());
+      break;
+    case 21: // ctrl-U
+      erase(0, cursor);
+      break;
+    case 23: { // ctrl-W, the word before the cursor
+      size_t word_start = cursor;
+      while(word_start > 0 && buffer[word_start - 1] == ' ') --word_start;
+      while(word_start > 0 && buffer[word_start - 1] != ' ') --word_start;
+      erase(word_start, cursor);
+      break;
+    }
+    case 12: // ctrl-L
+      output("\x1b[H\x1b[2J");
+      break;
+    case '\t':
+      complete();
+      break;
+    case 27:
+      key_state = SMASH_KEY_ESC;
+      return SMASH_EDIT_MORE;
+    default:
+      if((unsigned char)c < 32) return SMASH_EDIT_MORE;
+      insert(string(1, c));
+  }
+  redraw();
+  return SMASH_EDIT_MORE;
+}
+
+// ESC [ <params> <final> (or ESC O <final>) sequences sent by special keys
+void LineEditor::feedEscape(char c) {
+  if(key_state == SMASH_KEY_ESC) {
+    key_state = c == '[' || c == 'O' ? SMASH_KEY_CSI : SMASH_KEY_NORMAL;
+    csi_params.clear();
+    return;
+  }
+  if((c >= '0' && c <= '9') || c == ';') {
+    csi_params += c;
+    return;
+  }
+  key_state = SMASH_KEY_NORMAL;
+
+  long history_size = SmallShell::getInstance().history.size();
+  switch(c) {
+    case 'A': // up
+      if(history_pos == 0) {
+        edited_line = buffer;
+        if(history_size > 0) showHistory(history_size);
+      } else if(history_pos > 1) {
+        showHistory(history_pos - 1);
+      }
+      break;
+    case 'B': // down
+      if(history_pos == 0) break;
+      if(history_pos < history_size) {
+        showHistory(history_pos + 1);
+      } else {
+        history_pos = 0;
+        buffer = edited_line;
+        cursor = buffer.length();
+      }
+      break;
+    case 'C': // right
+      if(cursor < buffer.length()) ++cursor;
+      break;
+    case 'D': // left
+      if(cursor > 0) --cursor;
+      break;
+    case 'H':
+      cursor = 0;
+      break;
+    case 'F':
+      cursor = buffer.length();
+      break;
+    case '~': // home (1, 7), delete (3), end (4, 8)
+      if(csi_params == "1" || csi_params == "7") cursor = 0;
+      else if(csi_params == "4" || csi_params == "8") cursor = buffer.length();
+      else if(csi_params == "3" && cursor < buffer.length()) erase(cursor, cursor + 1);
+      break;
+  }
+}
+
+void LineEditor::insert(const string& text) {
+  buffer.insert(cursor, text);
+  cursor += text.length();
+}
+
+void LineEditor::erase(size_t begin, size_t end) {
+  buffer.erase(begin, end - begin);
+  cursor = begin;
+}
+
+void LineEditor::showHistory(long n) {
+  history_pos = n;
+  buffer = SmallShell::getInstance().history.entry(n);
+  cursor = buffer.length();
+}
+
+string _commonPrefix(const string& a, const string& b) {
+  size_t len = 0;
+  while(len < a.length() && len < b.length() && a[len] == b[len]) ++len;
+  return a.substr(0, len);
+}
+
+// backslashes the characters the lexer would otherwise interpret
+string _escapeCompletion(const string& name) {
+  string escaped;
+  for(size_t i = 0; i < name.length(); ++i) {
+    if(strchr(" \t\\'\"|&>;()$`*?{}", name[i])) escaped += '\\';
+    escaped += name[i];
+  }
+  return escaped;
+}
+
+// Completes the word before the cursor: to the single candidate, or to the
+// longest prefix all candidates share, or else lists the candidates.
+void LineEditor::complete() {
+  SmallShell& smash = SmallShell::getInstance();
+  size_t word_start = cursor;
+  while(word_start > 0 && !_isWhitespace(buffer[word_start - 1]) && !_isOperatorChar(buffer[word_start - 1])) {
+    --word_start;
+  }
+  string word = buffer.substr(word_start, cursor - word_start);
+
+  // the command the word belongs to starts after the last | or &
+  size_t segment_start = word_start == 0 ? string::npos : buffer.find_last_of("|&", word_start - 1);
+  segment_start = segment_start == string::npos ? 0 : segment_start + 1;
+  CommandLine segment(buffer.substr(segment_start, word_start - segment_start).c_str());
+  const char* command = segment.firstWord();
+
+  set<string> candidates;
+  string common;
+  bool has_common = false;
+  bool truncated = false;
+  if(segment.num_words == 0 && word.find('/') == string::npos) { // a command name
+    for(int i = 0; i < NUM_BUILTINS; ++i) {
+      if(strncmp(BUILTIN_NAMES[i], word.c_str(), word.length()) == 0) candidates.insert(BUILTIN_NAMES[i]);
+    }
+    executables.refresh();
+    vector<string> names;
+    executables.collect(word, &names, LIST_LIMIT);
+    truncated = names.size() >= LIST_LIMIT;
+    if(!names.empty()) {
+      common = executables.extend(word); // the prefix shared by all names, not just the collected ones
+      has_common = true;
+    }
+    candidates.insert(names.begin(), names.end());
+  } else if(word.find_first_not_of("0123456789") == string::npos &&
+            (strcmp(command, "fg") == 0 || strcmp(command, "bg") == 0 ||
+             strcmp(command, "kill") == 0 || strcmp(command, "setcore") == 0)) {
+    for(JobsList::JobEntry* job = smash.jobs.first_job; job != nullptr; job = job->next) {
+      string job_id = to_string(job->job_id);
+      if(job_id.compare(0, word.length(), word) == 0) candidates.insert(job_id);
+    }
+  } else { // a path
+    size_t slash = word.rfind('/');
+    string dir_part = slash == string::npos ? "" : word.substr(0, slash + 1);
+    string base = slash == string::npos ? word : word.substr(slash + 1);
+    DIR* dir = opendir(dir_part.empty() ? "." : dir_part.c_str());
+    struct dirent* entry;
+    while(dir != nullptr && (entry = readdir(dir)) != nullptr) {
+      string name = entry->d_name;
+      if(name == "." || name == "..") continue;
+      if(name[0] == '.' && (base.empty() || base[0] != '.')) continue;
+      if(name.compare(0, base.length(), base) != 0) continue;
+      struct stat entry_stat;
+      bool is_dir = entry->d_type == DT_DIR ||
+                    ((entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN) &&
+                     fstatat(dirfd(dir), entry->d_name, &entry_stat, 0) == 0 && S_ISDIR(entry_stat.st_mode));
+      candidates.insert(dir_part + name + (is_dir ? "/" : ""));
+    }
+    if(dir != nullptr) closedir(dir);
+  }
+
+  for(auto it = candidates.begin(); it != candidates.end(); ++it) {
+    common = has_common ? _commonPrefix(common, *it) : *it;
+    has_common = true;
+  }
+  if(candidates.empty()) {
+    output("\a");
+    return;
+  }
+  if(candidates.size() == 1 && !truncated) {
+    const string& only = *candidates.begin();
+    erase(word_start, cursor);
+    insert(_escapeCompletion(only) + (only[only.length() - 1] == '/' ? "" : " "));
+    return;
+  }
+  if(common.length() > word.length()) {
+    erase(word_start, cursor);
+    insert(_escapeCompletion(common));
+    return;
+  }
+
+  string listing = "\n";
+  size_t listed = 0;
+  for(auto it = candidates.begin(); it != candidates.end() && listed < LIST_LIMIT; ++it, ++listed) {
+    listing += *it + "  ";
+  }
+  if(truncated || candidates.size() > LIST_LIMIT) listing += "...";
+  output(listing + "\n");
+}
+
+void LineEditor::redraw() {
+  string screen = "\r" + prompt + buffer + "\x1b[K";
+  if(cursor < buffer.length()) screen += "\x1b[" + to_string(buffer.length() - cursor) + "D";
+  output(screen);
+}
+
+void LineEditor::output(const string& text) {
+  for(size_t written = 0; written < text.length(); ) {
+    ssize_t n = write(STDOUT_FILENO, text.c_str() + written, text.length() - written);
+    if(n < 0) {
+      if(errno == EINTR) continue;
+      return;
+    }
+    written += n;
+  }
+}
+
+/**
+* Reads one line from the terminal, with editing, running the event loop
+* until input comes. Returns false at EOF (ctrl-D on an empty line, or the
+* terminal went away).
+*/
+bool LineEditor::readLine(const string& new_prompt, string* line) {
+  if(!begin(new_prompt)) {
+    return false;
+  }
+  SmallShell& smash = SmallShell::getInstance();
+  char input[256];
+  while(true) {
+    if(pending_input.empty()) {
+      if(!smash.waitEvents(STDIN_FILENO, -1)) {
+        continue; // e.g. ctrl-C at the prompt or a job finished, already handled
+      }
+      ssize_t bytes_read = read(STDIN_FILENO, input, sizeof(input));
+      if(bytes_read < 0 && (errno == EINTR || errno == EAGAIN)) {
+        continue;
+      }
+      if(bytes_read <= 0) {
+        if(bytes_read < 0) perror("smash error: read failed");
+        end();
+        return false;
+      }
+      pending_input.assign(input, bytes_read);
+    }
+    size_t used = 0;
+    edit_result_t result = SMASH_EDIT_MORE;
+    while(used < pending_input.length() && result == SMASH_EDIT_MORE) {
+      result = feed(pending_input[used++], line);
+    }
+    pending_input.erase(0, used);
+    if(result != SMASH_EDIT_MORE) return result == SMASH_EDIT_LINE;
+  }
+}
+
+// ========================== Event Loop =========================== //
+/**
+* Sets up the event loop: signals are blocked and read from a signalfd
+* instead, which one epoll instance watches together with the timeout
+* timerfd (and the input while smash waits for a line). Nothing runs in
+* signal context. Without it (smash code linked into a benchmark) waits
+* simply block.
+*/
+bool SmallShell::initEvents(const sigset_t& signals) {
+  shell_signals = signals;
+  if(sigprocmask(SIG_BLOCK, &signals, nullptr) < 0) {
+    perror("smash error: sigprocmask failed");
+    return false;
+  }
+  if((signal_fd = _moveAboveUserFds(signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC))) < 0) {
+    perror("smash error: signalfd failed");
+  } else if((epoll_fd = _moveAboveUserFds(epoll_create1(EPOLL_CLOEXEC))) < 0) {
+    perror("smash error: epoll_create1 failed");
+  } else {
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = signal_fd;
+    if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &event) == 0) {
+      event.data.fd = timers.timer_fd;
+      if(timers.timer_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timers.timer_fd, &event) == 0) {
+        return true;
+      }
+    }
+    perror("smash error: epoll_ctl failed");
+  }
+
+  // no event loop: let the signals take their default actions again
+  if(epoll_fd >= 0) close(epoll_fd);
+  if(signal_fd >= 0) close(signal_fd);
+  epoll_fd = signal_fd = -1;
+  sigprocmask(SIG_UNBLOCK, &signals, nullptr);
+  return false;
+}
+
+/**
+* One turn of the event loop: waits up to timeout_ms (-1 for no limit) for
+* a signal, a timeout or, if input_fd >= 0, input, and handles the signals
+* and timeouts that came. When smash is waiting for input, finished jobs
+* are reaped (and reported) right away too. Returns true if input_fd is
+* readable.
+*/
+bool SmallShell::waitEvents(int input_fd, int timeout_ms) {
+  if(epoll_fd < 0) return input_fd >= 0; // no event loop, the caller just blocks
+
+  // the input is armed one-shot, so type-ahead doesn't wake up a foreground wait
+  if(input_fd >= 0 && input_watched != input_fd) {
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLONESHOT;
+    event.data.fd = input_fd;
+    if(epoll_ctl(epoll_fd, EPOLL_CTL_MOD, input_fd, &event) < 0 &&
+       (errno != ENOENT || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, input_fd, &event) < 0)) {
+      if(errno != EPERM) perror("smash error: epoll_ctl failed");
+      timeout_ms = 0; // a regular file (EPERM) is always readable
+    } else {
+      input_watched = input_fd;
+    }
+  }
+
+  struct epoll_event events[4];
+  int num_events = epoll_wait(epoll_fd, events, 4, timeout_ms);
+  if(num_events < 0) {
+    if(errno != EINTR) perror("smash error: epoll_wait failed");
+    return false;
+  }
+
+  // notices go on a line of their own, then the line being edited is redrawn
+  bool input_ready = input_fd >= 0 && input_watched != input_fd;
+  bool editing = editor.is_raw;
+  bool cleared = false;
+  for(int i = 0; i < num_events; ++i) {
+    int fd = events[i].data.fd;
+    if(fd != signal_fd && fd != timers.timer_fd) { // the one-shot input fired
+      input_watched = -1;
+      input_ready = input_ready || fd == input_fd;
+      continue;
+    }
+    if(editing && !cleared) {
+      editor.output("\r\x1b[K");
+      cleared = true;
+    }
+    if(fd == signal_fd) handleSignals();
+    else handleTimers();
+  }
+  if(input_fd >= 0) jobs.removeFinishedJobs();
+  if(cleared) {
+    cout.flush();
+    editor.redraw();
+  }
+  return input_ready;
+}
+
+/**
+* Does the work of the signals read from the signalfd: ctrl-C and ctrl-Z
+* act on the foreground process group, SIGCHLD marks the jobs for reaping.
+* Signals that came since the last call are coalesced into one.
+*/
+void SmallShell::handleSignals() {
+  bool got_sigint = false;
+  bool got_sigtstp = false;
+  bool got_sigalrm = false;
+  struct signalfd_siginfo infos[16];
+  ssize_t bytes_read;
+  while((bytes_read = read(signal_fd, infos, sizeof(infos))) > 0) {
+    for(size_t i = 0; i < bytes_read / sizeof(infos[0]); ++i) {
+      switch(infos[i].ssi_signo) {
+        case SIGINT:  got_sigint = true; break;
+        case SIGTSTP: got_sigtstp = true; break;
+        case SIGALRM: got_sigalrm = true; break;
+        case SIGCHLD: got_sigchld = true; break;
+      }
+    }
+  }
 
-  if(pid == 0){ // child process
-    SmallShell& smash = SmallShell::getInstance();
-    smash.forked_from_smash = true;
-
-    if(setpgrp() < 0){
-      perror("smash error: setpgrp failed");
-      delete this;
-      exit(0);
-    }
-    // check if complex external command or not
-    if(_isComplexExternalCommand(cmd)){ // complex command
-      char complex_cmd[COMMAND_ARGS_MAX_LENGTH];
-      strcpy(complex_cmd, cmd.c_str());
-      char bash[] = "/bin/bash";
-      char cflag[] = "-c";
-      char* complex_args[] = {bash,cflag, complex_cmd, nullptr};
-      execvp(bash, complex_args);
-    } else { // not complex command
-      execvp(argv[0],argv);
-    }
-
-    // if reached here, execvp failed, exit.
-    perror("smash error: execvp failed");
-    delete this;
-    exit(0);
-  } else { // parent process (shell)
-    if(is_background){ // background command
-      smash.jobs.removeFinishedJobs(); // need to remove finished jobs before adding new job
-      smash.jobs.addJob(cmd, pid);
-      if(waitpid(pid, nullptr, WNOHANG) < 0){
-        perror("smash error: waitpid failed");
-        return;
+  if(got_sigint) {
+    cout << "smash: got ctrl-C\n";
+    if(curr_fg_pid > 0) {
+      if(kill(-curr_fg_pid, SIGINT) < 0) {
+        perror("smash error: kill failed");
+      } else {
+        if(curr_fg_jobid > 0) {
+          jobs.removeJobById(curr_fg_jobid);
+        }
+        cout << "smash: process " << curr_fg_pid << " was killed\n";
+        curr_fg_cmd = "";
+        curr_fg_pid = -1;
+        curr_fg_jobid = -1;
       }
     }
-    else { // foreground command
-      smash.curr_fg_pid = pid;
-      smash.curr_fg_cmd = cmd;
-      if(waitpid(pid, nullptr, WUNTRACED) < 0){
-        perror("smash error: waitpid failed");
-        // clean shell state
-        smash.curr_fg_pid = -1;
-        smash.curr_fg_cmd = "";
-        return;
+  }
+
+  if(got_sigtstp) {
+    cout << "smash: got ctrl-Z\n";
+    // non-negative curr_fg_pid means a process group is currently running in
+    // foreground; SIGSTOP stops every process of it, even ones that ignore SIGTSTP
+    if(curr_fg_pid > 0) {
+      if(kill(-curr_fg_pid, SIGSTOP) < 0) {
+        perror("smash error: kill failed");
+      } else {
+        JobsList::JobEntry* job = curr_fg_jobid > 0 ? jobs.getJobById(curr_fg_jobid) : nullptr;
+        if(job != nullptr) {
+          job->resetTimer();
+          jobs.setJobStopped(job, true);
+        } else if(curr_fg_jobid <= 0) {
+          jobs.addJob(curr_fg_cmd, curr_fg_pid, true);
+        }
+        cout << "smash: process " << curr_fg_pid << " was stopped\n";
+        curr_fg_cmd = "";
+        curr_fg_pid = -1;
+        curr_fg_jobid = -1;
       }
-      // at this point, child process is finished
-      smash.curr_fg_pid = -1;
-      smash.curr_fg_cmd = "";
     }
   }
-}
-
-// ======================== JobsCommand =========================== //
-JobsCommand::JobsCommand(const char* cmd_line) : BuiltInCommand(cmd_line) {}
 
-void JobsCommand::execute() {
-  SmallShell& smash = SmallShell::getInstance();
-  smash.jobs.removeFinishedJobs(); // need to remove finished jobs before adding new job
-  smash.jobs.printJobsList();
+  if(got_sigalrm) {
+    handleTimers(); // an alarm sent from outside just checks the timeouts early
+  }
+  cout.flush();
 }
 
-// ========================= Foreground Command ==================== //
-ForegroundCommand::ForegroundCommand(const char* cmd_line) : BuiltInCommand(cmd_line) {}
+// the timerfd expired: kill the commands whose timeout has passed
+void SmallShell::handleTimers() {
+  uint64_t expirations;
+  if(read(timers.timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+    perror("smash error: read failed");
+  }
+  cout << "smash: got an alarm\n";
+  timers.expire();
+  cout.flush();
+}
 
-void ForegroundCommand::execute() {
-  SmallShell& smash = SmallShell::getInstance();
-  JobsList::JobEntry* job_to_fg;
-  int job_id_to_fg;
-  
-  // check input and find job_to_fg
-  if(argc > 2){
-    cerr << "smash error: fg: invalid arguments\n";
-    return;
+/**
+* wait4 driven by the event loop: between checks of the child smash sleeps
+* in epoll until a SIGCHLD, so ctrl-C, ctrl-Z and timeouts are handled
+* while the foreground process runs.
+*/
+pid_t SmallShell::waitChild(pid_t pid, int* status, int options, struct rusage* usage) {
+  // the job reaper may have collected the child already
+  for(auto it = reaped_children.begin(); it != reaped_children.end(); ++it) {
+    if(pid > 0 ? it->first != pid : it->second.pgid != -pid) continue;
+    if(WIFSTOPPED(it->second.status) && !(options & WUNTRACED)) continue;
+    pid_t waited = it->first;
+    *status = it->second.status;
+    if(usage != nullptr) *usage = it->second.usage;
+    reaped_children.erase(it);
+    return waited;
   }
-  if(argc == 1){
-    if(smash.jobs.job_vector.empty()){
-      cerr << "smash error: fg: jobs list is empty\n";
-      return;
-    }
-    job_to_fg = smash.jobs.getLastJob(&job_id_to_fg);
-  } else if(argc == 2){
-    try {
-      job_id_to_fg = stoi(argv[1]);
-    } catch(const exception& e){
-      cerr << "smash error: fg: invalid arguments\n";
-      return;
-    }
-    job_to_fg = smash.jobs.getJobById(job_id_to_fg);
-    if(job_to_fg == nullptr) {
-      cerr << "smash error: fg: job-id " << job_id_to_fg << " does not exist\n";
-      return;
+  while(true) {
+    if(epoll_fd < 0 || (options & WNOHANG)) {
+      pid_t waited = wait4(pid, status, options, usage);
+      if(waited >= 0 || errno != EINTR) return waited;
+      continue;
     }
+    // a child that changes state after this check leaves SIGCHLD pending on the signalfd
+    pid_t waited = wait4(pid, status, options | WNOHANG, usage);
+    if(waited != 0) return waited;
+    waitEvents(-1, -1);
   }
-  // end of input check, reaching here means job_to_fg has been found
-  if(kill(job_to_fg->process_id, SIGCONT) < 0){
-    perror("smash error: kill failed");
-    return;
-  }
-  int job_process_id = job_to_fg->process_id;
-  string job_cmd = job_to_fg->cmd;
-
-  smash.curr_fg_pid = job_process_id;
-  smash.curr_fg_cmd = job_cmd;
-  smash.curr_fg_jobid = job_id_to_fg;
-
-  cout << job_cmd << " : " << job_process_id << "\n";
-
-  if(waitpid(job_process_id, nullptr, WUNTRACED) < 0){
-    perror("smash error: waitpid failed");
-    return;
-  }
-  // at this point, process is finished
-  smash.curr_fg_pid = -1;
-  smash.curr_fg_cmd = "";
-  smash.curr_fg_jobid = -1;
 }
 
-// ========================= Background Command ===================== //
-BackgroundCommand::BackgroundCommand(const char* cmd_line) : BuiltInCommand(cmd_line) {}
-
-void BackgroundCommand::execute() {
-    SmallShell& smash = SmallShell::getInstance();
-    JobsList::JobEntry* job_to_bg;
-    int job_id_to_bg;
-    
-    // check input and find job_to_bg
-    if(argc > 2){
-      cerr << "smash error: bg: invalid arguments\n";
-      return;
+/**
+* The main loop of smash: reads command lines from input_fd (through the
+* line editor on a terminal) and runs them, while the signals, timeouts and
+* finished jobs are handled as they happen. Returns the exit status of smash.
+*/
+int SmallShell::run(int input_fd, bool interactive, bool use_editor) {
+  notify_jobs = interactive;
+  // a script stays open while its commands run, keep it clear of their redirections
+  LineReader reader(input_fd == STDIN_FILENO ? input_fd : _moveAboveUserFds(input_fd));
+  string cmd_line;
+  while(true) {
+    if(interactive) {
+      jobs.removeFinishedJobs(); // jobs that finished while the last command ran
     }
-    if(argc == 1){
-      if(smash.jobs.job_vector.empty()){
-        cerr << "smash error: bg: there is no stopped jobs to resume\n";
-        return;
+    if(use_editor) {
+      if(!editor.readLine(getPromptMessage() + "> ", &cmd_line)) {
+        break; // EOF
       }
-      job_to_bg = smash.jobs.getLastStoppedJob(&job_id_to_bg);
-    } else if(argc == 2){
-      try {
-        job_id_to_bg = stoi(argv[1]);
-      } catch(const exception& e){
-        cerr << "smash error: bg: invalid arguments\n";
-        return;
+    } else {
+      if(interactive) {
+        cout << getPromptMessage() << "> " << flush;
       }
-      job_to_bg = smash.jobs.getJobById(job_id_to_bg);
-      if(job_to_bg == nullptr) {
-        cerr << "smash error: bg: job-id " << job_id_to_bg << " does not exist\n";
-        return;
+      bool got_line;
+      while(!(got_line = reader.nextLine(cmd_line)) && !reader.atEof()) {
+        if(waitEvents(input_fd, -1) && reader.fill() < 0 && errno != EINTR && errno != EAGAIN) {
+          perror("smash error: read failed");
+          break;
+        }
+      }
+      if(!got_line) {
+        break; // EOF
       }
+      reader.syncOffset();
     }
-    // end of input check, reaching here means job_to_bg has been found
-    if(job_to_bg->is_stopped == false) {
-      cerr << "smash error: bg: job-id " << job_id_to_bg << " is already running in the background\n";
-      return;
+    if(interactive) {
+      if(!history.expand(cmd_line)) {
+        continue;
+      }
+      history.add(cmd_line);
     }
+    executeCommand(cmd_line.c_str());
+    cout.flush();
+  }
+  return last_status;
+}
 
-    if(kill(job_to_bg->process_id, SIGCONT) < 0){
-      perror("smash error: kill failed");
-      return;
-    }
-    cout << job_to_bg->cmd << " : " << job_to_bg->process_id << "\n";
+// ========================= Timer Queue ======================== //
+long _monotonicMs() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000L + now.tv_nsec / 1000000L;
+}
 
-    job_to_bg->is_stopped = false;
+TimerQueue::TimerQueue() : timer_fd(-1) {
+  if((timer_fd = _moveAboveUserFds(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC))) < 0) {
+    perror("smash error: timerfd_create failed");
+  }
 }
 
-// ========================= Kill Command =========================== //
-KillCommand::KillCommand(const char* cmd_line) : BuiltInCommand(cmd_line) {}
+TimerQueue::~TimerQueue() {
+  if(timer_fd >= 0) close(timer_fd);
+}
 
-void KillCommand::execute() {
-  SmallShell& smash = SmallShell::getInstance();
+void TimerQueue::arm(pid_t pid, long timeout_ms, const string& cmd) {
+  cancel(pid);
+  Timer timer = {_monotonicMs() + timeout_ms, cmd};
+  timers[pid] = timer;
+  deadlines.insert(make_pair(timer.deadline_ms, pid));
+  rearm();
+}
 
-  if(argc != 3){
-    cerr << "smash error: kill: invalid arguments\n";
-    return;
-  }
+void TimerQueue::cancel(pid_t pid) {
+  auto it = timers.find(pid);
+  if(it == timers.end()) return;
+  bool was_earliest = deadlines.begin()->second == pid;
+  deadlines.erase(make_pair(it->second.deadline_ms, pid));
+  timers.erase(it);
+  if(was_earliest) rearm();
+}
 
-  int sig_flag;
-  int job_id;
+/**
+* Kills every process whose deadline has passed and arms the timerfd for
+* the next deadline. Called when the timerfd expires; an early or stale
+* expiry finds nothing due and only re-arms.
+*/
+void TimerQueue::expire() {
+  long now = _monotonicMs();
+  while(!deadlines.empty() && deadlines.begin()->first <= now) {
+    pid_t pid = deadlines.begin()->second;
+    string timed_cmd = timers[pid].cmd;
+    deadlines.erase(deadlines.begin());
+    timers.erase(pid);
+
+    // only kill a pid that is still our child (running, stopped or a zombie),
+    // never an unrelated process that reused the pid
+    siginfo_t info;
+    info.si_pid = 0;
+    if(waitid(P_PID, pid, &info, WEXITED | WSTOPPED | WCONTINUED | WNOHANG | WNOWAIT) < 0) {
+      continue;
+    }
+    // the command leads its own process group: take down what it forked too
+    // (e.g. the processes of a bash -c), or just the pid if it has no group
+    if(kill(-pid, SIGKILL) < 0 && (errno != ESRCH || kill(pid, SIGKILL) < 0)) {
+      perror("smash error: kill failed");
+      continue;
+    }
+    cout << "smash: " << timed_cmd << " timed out!\n";
+  }
+  rearm();
+}
 
-  // validate arguments, convert to integers.
-  string sig_flag_str = argv[1];
-  string job_id_str = argv[2];
+void TimerQueue::rearm() {
+  if(timer_fd < 0) return;
+  struct itimerspec timer_value;
+  memset(&timer_value, 0, sizeof(timer_value));
+  if(!deadlines.empty()) { // absolute, a deadline already passed expires at once
+    long deadline_ms = deadlines.begin()->first;
+    timer_value.it_value.tv_sec = deadline_ms / 1000;
+    timer_value.it_value.tv_nsec = (deadline_ms % 1000) * 1000000L;
+  }
+  // a zero it_value disarms the timer when nothing is pending
+  if(timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &timer_value, nullptr) < 0) {
+    perror("smash error: timerfd_settime failed");
+  }
+}
 
-  if(sig_flag_str[0] != '-') {
-    cerr << "smash error: kill: invalid arguments\n";
-    return;
+// ========================= Setcore Command ======================== //
+// Parses a cpu list like "0-3,8" (the format of taskset -c and of
+// /sys/devices/system/cpu/online) into cpus.
+bool _parseCpuList(const char* list, cpu_set_t* cpus) {
+  CPU_ZERO(cpus);
+  const char* p = list;
+  while(true) {
+    char* end;
+    if(*p < '0' || *p > '9') return false;
+    long first = strtol(p, &end, 10);
+    long last = first;
+    if(*end == '-') {
+      p = end + 1;
+      if(*p < '0' || *p > '9') return false;
+      last = strtol(p, &end, 10);
+    }
+    if(last < first || last >= CPU_SETSIZE) return false;
+    for(long cpu = first; cpu <= last; ++cpu) CPU_SET(cpu, cpus);
+    if(*end == '\0' || *end == '\n') return true;
+    if(*end != ',') return false;
+    p = end + 1;
   }
-  sig_flag_str.erase(0,1); // remove "-" from sig flag arg
+}
 
-  try{
-    sig_flag = stoi(sig_flag_str);
-    job_id = stoi(job_id_str);
-  } catch (const exception& e) {
-    cerr << "smash error: kill: invalid arguments\n";
-    return;
+vector<int> _allowedCpus() {
+  vector<int> allowed;
+  cpu_set_t cpus;
+  if(sched_getaffinity(0, sizeof(cpu_set_t), &cpus) < 0) {
+    perror("smash error: sched_getaffinity failed");
+    return allowed;
+  }
+  for(int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if(CPU_ISSET(cpu, &cpus)) allowed.push_back(cpu);
   }
+  return allowed;
+}
 
-  JobsList::JobEntry* job = smash.jobs.getJobById(job_id);
-  if(job == nullptr){
-    cerr << "smash error: kill: job-id " << job_id << " does not exist\n";
-    return;
+// cpu a job last ran on (field 39 of /proc/<pid>/stat), -1 if it is stopped or gone
+int _lastCpuOf(pid_t pid) {
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if(fd < 0) return -1;
+  char buf[1024];
+  ssize_t len = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if(len <= 0) return -1;
+  buf[len] = '\0';
+
+  // the command name may contain spaces, fields are counted after its ')'
+  char* p = strrchr(buf, ')');
+  if(p == nullptr) return -1;
+  char state = p[2];
+  if(state == 'T' || state == 't' || state == 'Z' || state == 'X') return -1;
+  int field = 2;
+  for(; *p && field < 39; ++p) {
+    if(*p == ' ') ++field;
   }
+  return field == 39 ? atoi(p) : -1;
+}
 
-  int pid = job->process_id;
+CpuPlacement::CpuPlacement() : policy(SMASH_PLACE_OFF), next_cpu(0) {}
 
-  // reaching here means args are valid
-  if(kill(pid, sig_flag) < 0){
-    perror("smash error: kill failed");
-    return;
+const char* CpuPlacement::policyName() const {
+  switch(policy) {
+    case SMASH_PLACE_RR: return "rr";
+    case SMASH_PLACE_LEAST: return "least";
+    case SMASH_PLACE_NUMA: return "numa";
+    default: return "off";
   }
+}
 
-  // updating joblist
-  if(sig_flag == SIGSTOP || sig_flag == SIGTSTP) {
-    job->is_stopped = true;
+/**
+* Fills cpus with the placement of a new background job. Returns false when
+* the job should not be pinned (policy off, or nothing to choose from).
+*/
+bool CpuPlacement::choose(cpu_set_t* cpus) {
+  if(policy == SMASH_PLACE_OFF) return false;
+  vector<int> allowed = _allowedCpus();
+  if(allowed.empty()) return false;
+  CPU_ZERO(cpus);
+
+  if(policy == SMASH_PLACE_RR) {
+    CPU_SET(allowed[next_cpu++ % allowed.size()], cpus);
+    return true;
   }
 
-  if(sig_flag == SIGCONT) {
-    job->is_stopped = false;
+  // jobs that are currently running, by the cpu they last ran on
+  vector<int> jobs_on_cpu(CPU_SETSIZE, 0);
+  JobsList& jobs = SmallShell::getInstance().jobs;
+  for(JobsList::JobEntry* job = jobs.first_job; job != nullptr; job = job->next) {
+    if(job->is_stopped) continue;
+    int cpu = _lastCpuOf(job->process_id);
+    if(cpu >= 0 && cpu < CPU_SETSIZE) ++jobs_on_cpu[cpu];
   }
 
-  cout << "signal number " << sig_flag << " was sent to pid " << pid << "\n";
+  if(policy == SMASH_PLACE_LEAST) {
+    int best = allowed[0];
+    for(auto it = allowed.begin(); it != allowed.end(); ++it) {
+      if(jobs_on_cpu[*it] < jobs_on_cpu[best]) best = *it;
+    }
+    CPU_SET(best, cpus);
+    return true;
+  }
+
+  // numa: the first node with fewer jobs than cpus gets the job, else the
+  // least loaded node; the job may run on any allowed cpu of that node
+  glob_t nodes;
+  if(glob("/sys/devices/system/node/node*/cpulist", 0, nullptr, &nodes) != 0) {
+    globfree(&nodes);
+    return false; // no NUMA information, nothing better than the default
+  }
+  int best_jobs = 0;
+  int best_cpus = 0;
+  for(size_t i = 0; i < nodes.gl_pathc; ++i) {
+    int fd = open(nodes.gl_pathv[i], O_RDONLY | O_CLOEXEC);
+    if(fd < 0) continue;
+    char list[4096];
+    ssize_t len = read(fd, list, sizeof(list) - 1);
+    close(fd);
+    cpu_set_t node_cpus;
+    if(len <= 0) continue;
+    list[len] = '\0';
+    if(!_parseCpuList(list, &node_cpus)) continue;
+
+    cpu_set_t node_allowed;
+    CPU_ZERO(&node_allowed);
+    int node_jobs = 0;
+    int node_size = 0;
+    for(auto it = allowed.begin(); it != allowed.end(); ++it) {
+      if(!CPU_ISSET(*it, &node_cpus)) continue;
+      CPU_SET(*it, &node_allowed);
+      ++node_size;
+      node_jobs += jobs_on_cpu[*it];
+    }
+    if(node_size == 0) continue;
+
+    // a node with room beats a full one, among full nodes compare jobs per
+    // cpu (node_jobs / node_size < best_jobs / best_cpus, without dividing)
+    bool has_room = node_jobs < node_size;
+    bool best_has_room = best_jobs < best_cpus;
+    if(best_cpus == 0 || (has_room && !best_has_room) ||
+       (!has_room && !best_has_room && (long)node_jobs * best_cpus < (long)best_jobs * node_size)) {
+      *cpus = node_allowed;
+      best_jobs = node_jobs;
+      best_cpus = node_size;
+    }
+  }
+  globfree(&nodes);
+  return best_cpus > 0;
 }
 
-// ========================= Setcore Command ======================== //
-SetcoreCommand::SetcoreCommand(const char* cmd_line) : BuiltInCommand(cmd_line) {}
+SetcoreCommand::SetcoreCommand(CommandLine* line) : BuiltInCommand(line) {}
 
+// setcore <job-id> <cpu-list>: pins a job, e.g. setcore 1 0-3,8
+// setcore auto [rr|least|numa|off]: placement of new background jobs
 void SetcoreCommand::execute() {
+  SmallShell& smash = SmallShell::getInstance();
+
+  if((argc == 2 || argc == 3) && strcmp(argv[1], "auto") == 0) {
+    if(argc == 2) {
+      cout << "smash: setcore auto " << smash.placement.policyName() << "\n";
+      return;
+    }
+    if(strcmp(argv[2], "rr") == 0) smash.placement.policy = SMASH_PLACE_RR;
+    else if(strcmp(argv[2], "least") == 0) smash.placement.policy = SMASH_PLACE_LEAST;
+    else if(strcmp(argv[2], "numa") == 0) smash.placement.policy = SMASH_PLACE_NUMA;
+    else if(strcmp(argv[2], "off") == 0) smash.placement.policy = SMASH_PLACE_OFF;
+    else {
+      cerr << "smash error: setcore: invalid arguments\n";
+      return;
+    }
+    smash.placement.next_cpu = 0;
+    return;
+  }
+
   if(argc != 3) {
     cerr << "smash error: setcore: invalid arguments\n";
     return;
   }
 
   int job_id;
-  int core_num;
+  cpu_set_t new_core_set;
 
   try{
-    job_id = stoi(argv[1]);
-    core_num = stoi(argv[2]);
+    size_t parsed_len;
+    job_id = stoi(argv[1], &parsed_len);
+    if(parsed_len != strlen(argv[1])) throw invalid_argument(argv[1]);
   } catch (const exception& e) {
     cerr << "smash error: setcore: invalid arguments\n";
     return;  
   }
+  if(!_parseCpuList(argv[2], &new_core_set)) {
+    cerr << "smash error: setcore: invalid arguments\n";
+    return;
+  }
   // reaching here means args are valid
-  SmallShell& smash = SmallShell::getInstance();
   JobsList::JobEntry* job = smash.jobs.getJobById(job_id);
   if(job == nullptr) {
     cerr << "smash error: setcore: job-id " << job_id << " does not exist\n";
@@ -842,9 +3978,6 @@ void SetcoreCommand::execute() {
 
   // try to set core
   pid_t process_id = job->process_id;
-  cpu_set_t new_core_set;
-  CPU_ZERO(&new_core_set);
-  CPU_SET(core_num, &new_core_set);
   if(sched_setaffinity(process_id, sizeof(cpu_set_t), &new_core_set) < 0) {
     if(errno == EINVAL){
       cerr << "smash error: setcore: invalid core number\n";
@@ -878,39 +4011,144 @@ string _getFileTypeStr(mode_t st_mode) {
   }
 }
 
-GetFileTypeCommand::GetFileTypeCommand(const char* cmd_line) : BuiltInCommand(cmd_line) {}
+GetFileTypeCommand::GetFileTypeCommand(CommandLine* line) : BuiltInCommand(line), walk_busy(0) {}
 
-void GetFileTypeCommand::execute() {
-  if(argc != 2) {
-    cerr << "smash error: getfiletype: invalid arguments\n";
-    return;
+// a file with several hard links takes up its size once, like du counts it
+void GetFileTypeCommand::addToTotals(Totals* totals, const struct stat& file_stat) {
+  int type = (file_stat.st_mode & S_IFMT) >> 12;
+  ++totals->count[type];
+  if(file_stat.st_nlink > 1 && !S_ISDIR(file_stat.st_mode)) {
+    lock_guard<mutex> guard(linked_lock);
+    if(!linked_files.insert(make_pair(file_stat.st_dev, file_stat.st_ino)).second) return;
   }
+  totals->bytes[type] += file_stat.st_size;
+}
 
-  int fd = open(argv[1], O_RDONLY);
-  if(fd < 0) {
+/**
+* Sizes every entry of dir_path into totals, collecting the subdirectories
+* to read next. Entries are stat'ed relative to the directory fd, so no
+* path is resolved twice.
+*/
+void GetFileTypeCommand::readDirectory(const string& dir_path, Totals* totals, vector<string>* subdirs) {
+  int dir_fd = open(dir_path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if(dir_fd < 0) {
     perror("smash error: open failed");
     return;
   }
+  alignas(struct dirent64) char buf[1 << 16];
+  ssize_t bytes_read;
+  while((bytes_read = syscall(SYS_getdents64, dir_fd, buf, sizeof(buf))) > 0) {
+    for(ssize_t offset = 0; offset < bytes_read; ) {
+      const struct dirent64* dir_entry = (const struct dirent64*)(buf + offset);
+      offset += dir_entry->d_reclen;
+      const char* name = dir_entry->d_name;
+      if(name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+      struct stat file_stat;
+      if(fstatat(dir_fd, name, &file_stat, AT_SYMLINK_NOFOLLOW) < 0) {
+        perror("smash error: fstatat failed");
+        continue;
+      }
+      addToTotals(totals, file_stat);
+      if(S_ISDIR(file_stat.st_mode)) subdirs->push_back(dir_path + "/" + name);
+    }
+  }
+  if(bytes_read < 0) perror("smash error: getdents64 failed");
+  close(dir_fd);
+}
 
-  struct stat file_stat;
-  if(fstat(fd, &file_stat) < 0){
-    perror("smash error: fstat failed");
-    if(close(fd) < 0){
-      perror("smash error: close failed");
-      return;
+// takes directories off the queue until it is empty and no other worker can add more
+void GetFileTypeCommand::walkWorker() {
+  vector<Totals> totals(path_totals.size());
+  memset(totals.data(), 0, totals.size() * sizeof(Totals));
+  vector<string> subdirs;
+  unique_lock<mutex> guard(walk_lock);
+  while(true) {
+    walk_ready.wait(guard, [this] { return !walk_queue.empty() || walk_busy == 0; });
+    if(walk_queue.empty()) break;
+    pair<size_t, string> dir = walk_queue.front();
+    walk_queue.pop_front();
+    ++walk_busy;
+    guard.unlock();
+
+    subdirs.clear();
+    readDirectory(dir.second, &totals[dir.first], &subdirs);
+
+    guard.lock();
+    --walk_busy;
+    for(auto it = subdirs.begin(); it != subdirs.end(); ++it) {
+      walk_queue.push_back(make_pair(dir.first, *it));
     }
+    if(!subdirs.empty() || walk_busy == 0) walk_ready.notify_all();
+  }
+  for(size_t i = 0; i < totals.size(); ++i) {
+    for(int type = 0; type < 16; ++type) {
+      path_totals[i].count[type] += totals[i].count[type];
+      path_totals[i].bytes[type] += totals[i].bytes[type];
+    }
+  }
+}
+
+void GetFileTypeCommand::execute() {
+  bool recursive = argc > 1 && strcmp(argv[1], "-r") == 0;
+  int first_path = recursive ? 2 : 1;
+  if(argc <= first_path) {
+    cerr << "smash error: getfiletype: invalid arguments\n";
     return;
   }
 
-  string file_type = _getFileTypeStr(file_stat.st_mode);
-  off_t file_size = file_stat.st_size;
+  // the paths themselves are followed if they are symbolic links, like open did
+  size_t num_paths = argc - first_path;
+  vector<mode_t> path_modes(num_paths, 0);
+  path_totals.assign(num_paths, Totals());
+  memset(path_totals.data(), 0, num_paths * sizeof(Totals));
+  for(size_t i = 0; i < num_paths; ++i) {
+    struct stat file_stat;
+    if(fstatat(AT_FDCWD, argv[first_path + i], &file_stat, 0) < 0) {
+      perror("smash error: open failed"); // the message getfiletype always gave for a bad path
+      continue;
+    }
+    path_modes[i] = file_stat.st_mode;
+    addToTotals(&path_totals[i], file_stat);
+    if(recursive && S_ISDIR(file_stat.st_mode)) {
+      walk_queue.push_back(make_pair(i, string(argv[first_path + i])));
+    }
+  }
 
-  cout << argv[1] << "'s type is \"" << file_type << "\" and takes up " << file_size << " bytes\n";
+  if(!walk_queue.empty()) {
+    // reading directories mostly waits on the disk, so at least a few workers even on one cpu
+    size_t num_workers = max((size_t)4, _allowedCpus().size());
+    vector<thread> workers;
+    for(size_t i = 0; i < num_workers; ++i) {
+      workers.push_back(thread(&GetFileTypeCommand::walkWorker, this));
+    }
+    for(auto it = workers.begin(); it != workers.end(); ++it) it->join();
+  }
 
-  if(close(fd) < 0){
-    perror("smash error: close failed");
-    return;
+  Totals all_totals;
+  memset(&all_totals, 0, sizeof(all_totals));
+  for(size_t i = 0; i < num_paths; ++i) {
+    if(path_modes[i] == 0) continue;
+    unsigned long long path_bytes = 0;
+    for(int type = 0; type < 16; ++type) {
+      path_bytes += path_totals[i].bytes[type];
+      all_totals.count[type] += path_totals[i].count[type];
+      all_totals.bytes[type] += path_totals[i].bytes[type];
+    }
+    cout << argv[first_path + i] << "'s type is \"" << _getFileTypeStr(path_modes[i])
+         << "\" and takes up " << path_bytes << " bytes\n";
   }
+  if(num_paths == 1 && !recursive) return;
+
+  unsigned long total_count = 0;
+  unsigned long long total_bytes = 0;
+  for(int type = 0; type < 16; ++type) {
+    if(all_totals.count[type] == 0) continue;
+    cout << _getFileTypeStr(type << 12) << ": " << all_totals.count[type] << " entries, "
+         << all_totals.bytes[type] << " bytes\n";
+    total_count += all_totals.count[type];
+    total_bytes += all_totals.bytes[type];
+  }
+  cout << "total: " << total_count << " entries, " << total_bytes << " bytes\n";
 }
 
 // ========================= Chmod Command ========================== //
@@ -940,7 +4178,7 @@ bool _isFileModeValid(int file_mode){
   return true;
 }
 
-ChmodCommand::ChmodCommand(const char* cmd_line) : BuiltInCommand(cmd_line) {}
+ChmodCommand::ChmodCommand(CommandLine* line) : BuiltInCommand(line) {}
 
 void ChmodCommand::execute() {
   if(argc != 3) {
@@ -977,16 +4215,84 @@ JobsList::JobEntry::JobEntry(int job_id, std::string cmd, pid_t process_id, time
   cmd(cmd),
   process_id(process_id),
   entry_time(entry_time),
-  is_stopped(is_stopped) {}
+  is_stopped(is_stopped),
+  prev(nullptr),
+  next(nullptr),
+  prev_stopped(nullptr),
+  next_stopped(nullptr) {
+  memset(&usage, 0, sizeof(usage));
+}
+
+// Current usage of a live process from /proc, in the units of getrusage.
+// Returns false if the process is gone.
+bool _sampleUsage(pid_t pid, struct rusage* usage) {
+  char path[64];
+  char buf[4096];
+  snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if(fd < 0) return false;
+  ssize_t len = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if(len <= 0) return false;
+  buf[len] = '\0';
+
+  // fields after the command name: state(3) ... minflt(10) majflt(12) utime(14) stime(15)
+  char* p = strrchr(buf, ')');
+  if(p == nullptr) return false;
+  unsigned long minflt, majflt, utime, stime;
+  if(sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %lu %*u %lu %*u %lu %lu",
+            &minflt, &majflt, &utime, &stime) != 4) {
+    return false;
+  }
+  long ticks = sysconf(_SC_CLK_TCK);
+  memset(usage, 0, sizeof(*usage));
+  usage->ru_minflt = minflt;
+  usage->ru_majflt = majflt;
+  usage->ru_utime.tv_sec = utime / ticks;
+  usage->ru_utime.tv_usec = (utime % ticks) * 1000000 / ticks;
+  usage->ru_stime.tv_sec = stime / ticks;
+  usage->ru_stime.tv_usec = (stime % ticks) * 1000000 / ticks;
+
+  // peak rss and context switches are only in status
+  snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+  if((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) return true;
+  len = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if(len <= 0) return true;
+  buf[len] = '\0';
+  for(char* line = buf; line != nullptr && *line; line = strchr(line, '\n')) {
+    if(*line == '\n') ++line;
+    sscanf(line, "VmHWM: %ld", &usage->ru_maxrss);
+    sscanf(line, "voluntary_ctxt_switches: %ld", &usage->ru_nvcsw);
+    sscanf(line, "nonvoluntary_ctxt_switches: %ld", &usage->ru_nivcsw);
+  }
+  return true;
+}
+
+void _printUsage(const struct rusage& usage) {
+  cout << fixed << setprecision(2)
+       << "user " << usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 << "s"
+       << " sys " << usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6 << "s"
+       << " maxrss " << usage.ru_maxrss << "KB"
+       << " majflt " << usage.ru_majflt << " minflt " << usage.ru_minflt
+       << " nvcsw " << usage.ru_nvcsw << " nivcsw " << usage.ru_nivcsw;
+  cout.unsetf(ios::floatfield);
+}
 
-void JobsList::JobEntry::printEntry(time_t curr_time) const {
+void JobsList::JobEntry::printEntry(time_t curr_time, bool verbose) const {
   time_t seconds_elapsed = difftime(curr_time, entry_time);
   cout << "[" << job_id << "] " << cmd << " : " << process_id << " " <<seconds_elapsed << " secs";
   if(is_stopped) cout << " (stopped)";
   cout << "\n";
+  if(verbose) { // live numbers from /proc, or the last ones wait4 reported
+    struct rusage live_usage;
+    cout << "    ";
+    _printUsage(_sampleUsage(process_id, &live_usage) ? live_usage : usage);
+    cout << "\n";
+  }
 }
 
-void JobsList::JobEntry::resetTimerAndStop() {
+void JobsList::JobEntry::resetTimer() {
   time_t current_time = time(nullptr);
   if(current_time < 0){
     perror("smash error: time failed");
@@ -994,10 +4300,30 @@ void JobsList::JobEntry::resetTimerAndStop() {
   }
 
   this->entry_time = current_time;
-  this->is_stopped = true;
 }
 
-JobsList::JobsList() : max_job_id(0) {}
+JobsList::JobsList() :
+  first_job(nullptr),
+  last_job(nullptr),
+  first_stopped(nullptr),
+  last_stopped(nullptr),
+  max_job_id(0) {}
+
+JobsList::~JobsList() {
+  while(first_job) {
+    JobEntry* next = first_job->next;
+    delete first_job;
+    first_job = next;
+  }
+}
+
+size_t JobsList::size() const {
+  return jobs_by_id.size();
+}
+
+bool JobsList::empty() const {
+  return first_job == nullptr;
+}
 
 void JobsList::addJob(string cmd, pid_t pid, bool isStopped) {
   time_t current_time = time(nullptr);
@@ -1005,98 +4331,172 @@ void JobsList::addJob(string cmd, pid_t pid, bool isStopped) {
     perror("smash error: time failed");
     return;
   }
-  JobsList::JobEntry job(++max_job_id, cmd, pid, current_time, isStopped);
-  job_vector.push_back(job);
+  // new job always gets the highest id, so it goes at the end of the list
+  JobEntry* job = new JobEntry(++max_job_id, cmd, pid, current_time, false);
+  job->prev = last_job;
+  if(last_job) last_job->next = job;
+  else first_job = job;
+  last_job = job;
+
+  jobs_by_id[job->job_id] = job;
+  jobs_by_pid[pid] = job;
+  if(isStopped) setJobStopped(job, true);
 }
 
-void JobsList::printJobsList(){
+void JobsList::printJobsList(bool verbose){
   time_t current_time = time(nullptr);
   if(current_time < 0){
     perror("smash error: time failed");
     return;
   }
 
-  for(auto job : job_vector){
-    job.printEntry(current_time);
+  for(JobEntry* job = first_job; job != nullptr; job = job->next){
+    job->printEntry(current_time, verbose);
   }
 }
 
 void JobsList::killAllJobs() {
-  for(auto it = job_vector.begin(); it != job_vector.end(); ++it){
-    if(kill(it->process_id, SIGKILL) < 0) {
+  for(JobEntry* job = first_job; job != nullptr; job = job->next){
+    if(kill(-job->process_id, SIGKILL) < 0) {
       perror("smash error: kill failed");
     }
   }
 }
 
+// Reaping is driven by SIGCHLD: the event loop sets got_sigchld when it
+// reads one from the signalfd, and only then do we collect child events
+// with waitpid(-1). The common case (no child changed state since the last
+// prompt) costs a flag test, and each event goes straight to its job
+// through the pid index: the cost follows the events, not the job count.
+// A child is only peeked at first (WNOWAIT), as its process group can't be
+// asked for once it is reaped.
 void JobsList::removeFinishedJobs() {
   SmallShell& smash = SmallShell::getInstance();
-  if(smash.forked_from_smash) return;
-  
-  auto it = job_vector.begin();
-  while(it != job_vector.end()){
-    pid_t process_id = it->process_id;
-    pid_t res_pid = waitpid(process_id, nullptr, WNOHANG);
-    if(res_pid > 0){ // collected a finished process, remove job from list
-      it = job_vector.erase(it);
-    } else { // not finished
-      ++it;
+  if(!smash.got_sigchld) return;
+  smash.got_sigchld = false;
+
+  while(true) {
+    siginfo_t info;
+    info.si_pid = 0;
+    if(waitid(P_ALL, 0, &info, WEXITED | WSTOPPED | WCONTINUED | WNOHANG | WNOWAIT) < 0 || info.si_pid == 0) {
+      break;
     }
-  }
-  
-  // update max job id
-  if(job_vector.empty()){ // if empty, max is 0
-    max_job_id = 0;
-  } else { // else, max jobs id is the LAST item in vector
-    max_job_id = job_vector.back().job_id;
+    pid_t pgid = getpgid(info.si_pid);
+    int status;
+    struct rusage usage;
+    pid_t pid = wait4(info.si_pid, &status, WNOHANG | WUNTRACED | WCONTINUED, &usage);
+    if(pid <= 0) break;
+    handleChildEvent(pid, pgid < 0 ? pid : pgid, status, usage);
   }
 }
 
-JobsList::JobEntry* JobsList::getJobById(int jobId) {
-  // loop over jobs vector, break when found the correct id
-  for(auto it = job_vector.begin(); it != job_vector.end(); ++it){
-    if(it->job_id == jobId){
-      // found it
-      return &(*it); // return the address (&) of the job (*it)
+void JobsList::handleChildEvent(pid_t pid, pid_t pgid, int status, const struct rusage& usage) {
+  JobEntry* job = getJobByPid(pgid);
+  if(job == nullptr) job = getJobByPid(pid);
+  if(job == nullptr) {
+    // a foreground child (e.g. a stage of the running pipeline), kept for
+    // the wait of its command
+    if(!WIFCONTINUED(status)) {
+      SmallShell::ReapedChild reaped = {pgid, status, usage};
+      SmallShell::getInstance().reaped_children[pid] = reaped;
+    }
+    return;
+  }
+
+  if(WIFSTOPPED(status)) {
+    job->usage = usage;
+    setJobStopped(job, true);
+  } else if(WIFCONTINUED(status)) {
+    setJobStopped(job, false);
+  } else { // exited or killed by a signal: the job is done once its group has no process left
+    siginfo_t info;
+    if(waitid(P_PGID, job->process_id, &info, WEXITED | WSTOPPED | WCONTINUED | WNOHANG | WNOWAIT) == 0) {
+      return;
+    }
+    if(SmallShell::getInstance().notify_jobs) {
+      cout << "[" << job->job_id << "] " << (WIFSIGNALED(status) ? "Killed " : "Done ") << job->cmd << "\n";
     }
+    removeJobById(job->job_id);
   }
+}
+
+JobsList::JobEntry* JobsList::getJobById(int jobId) {
+  auto it = jobs_by_id.find(jobId);
+  return it == jobs_by_id.end() ? nullptr : it->second;
+}
 
-  // reaching here means job not found.
-  return nullptr;
+JobsList::JobEntry* JobsList::getJobByPid(pid_t pid) {
+  auto it = jobs_by_pid.find(pid);
+  return it == jobs_by_pid.end() ? nullptr : it->second;
 }
 
 // NOTE: this method doesn't kill the process
 // it only removes from list.
 // have to kill it separately before or after removal
 void JobsList::removeJobById(int jobId) {
-  for(auto it = job_vector.begin(); it != job_vector.end(); ++it){
-    if(it->job_id == jobId){
-      job_vector.erase(it);
-      break;
-    }
-  }
+  JobEntry* job = getJobById(jobId);
+  if(job == nullptr) return;
+
+  if(job->is_stopped) unlinkStopped(job);
+  if(job->prev) job->prev->next = job->next;
+  else first_job = job->next;
+  if(job->next) job->next->prev = job->prev;
+  else last_job = job->prev;
+
+  jobs_by_id.erase(job->job_id);
+  jobs_by_pid.erase(job->process_id);
+  SmallShell::getInstance().timers.cancel(job->process_id);
+  delete job;
+
+  // update max job id, the LAST job in the list has the max id (0 if empty)
+  max_job_id = last_job ? last_job->job_id : 0;
 }
 
 JobsList::JobEntry* JobsList::getLastJob(int* lastJobId){
-  if(job_vector.empty()) return nullptr;
+  if(last_job == nullptr) return nullptr;
 
-  *lastJobId = job_vector.back().job_id;
-  return &(job_vector.back());
+  *lastJobId = last_job->job_id;
+  return last_job;
 }
 
 JobsList::JobEntry* JobsList::getLastStoppedJob(int* jobId){
-  // iterate in REVERSE (from end to start)
-  // return the first stopped job (from the end)
-  for(auto it = job_vector.rbegin(); it != job_vector.rend(); ++it){
-    // if found, return the address (&) of the job (*it)
-    if(it->is_stopped){
-      *jobId = it->job_id;
-      return &(*it);
-    }     
-  }
-
-  // reaching here means no stopped jobs have been found
-  return nullptr;
+  if(last_stopped == nullptr) return nullptr;
+
+  *jobId = last_stopped->job_id;
+  return last_stopped;
+}
+
+void JobsList::setJobStopped(JobEntry* job, bool is_stopped) {
+  if(job->is_stopped == is_stopped) return;
+  job->is_stopped = is_stopped;
+  if(is_stopped) linkStopped(job);
+  else unlinkStopped(job);
+}
+
+// keeps the stopped list ordered by job id. The search starts at the tail
+// because the job being stopped is usually the newest one (ctrl-Z), which
+// makes the common case O(1).
+void JobsList::linkStopped(JobEntry* job) {
+  JobEntry* after = last_stopped;
+  while(after && after->job_id > job->job_id) {
+    after = after->prev_stopped;
+  }
+
+  job->prev_stopped = after;
+  job->next_stopped = after ? after->next_stopped : first_stopped;
+  if(job->next_stopped) job->next_stopped->prev_stopped = job;
+  else last_stopped = job;
+  if(after) after->next_stopped = job;
+  else first_stopped = job;
+}
+
+void JobsList::unlinkStopped(JobEntry* job) {
+  if(job->prev_stopped) job->prev_stopped->next_stopped = job->next_stopped;
+  else first_stopped = job->next_stopped;
+  if(job->next_stopped) job->next_stopped->prev_stopped = job->prev_stopped;
+  else last_stopped = job->prev_stopped;
+  job->prev_stopped = nullptr;
+  job->next_stopped = nullptr;
 }
 
 // ====================== End of JobList and JobEntry ==================== //
@@ -2,18 +2,100 @@
 #define SMASH_COMMAND_H_
 
 #include <vector>
+#include <string>
+#include <unordered_map>
+#include <set>
+#include <map>
+#include <list>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <sys/types.h>
+#include <signal.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <termios.h>
+
+// Bump allocator owned by a single command line. Everything the lexer
+// produces (token table, unquoted words and argv) is carved out of one block
+// and released together when the command is deleted. The first block is
+// sized for the line, further blocks are chained only if it runs out.
+class Arena {
+  struct Block {
+    Block* next;
+    size_t capacity;
+    size_t used;
+  };
+  Block* head; // block currently allocated from, older blocks follow it
+  size_t initial_capacity;
+
+  Block* newBlock(size_t capacity);
+
+ public:
+  explicit Arena(size_t capacity);
+  Arena(Arena const&)            = delete;
+  void operator=(Arena const&)   = delete;
+  ~Arena();
+  void* allocate(size_t size, size_t align);
+};
+
+enum token_t { SMASH_TOKEN_WORD, SMASH_TOKEN_PIPE, SMASH_TOKEN_ERR_PIPE,
+               SMASH_TOKEN_REDIRECT, SMASH_TOKEN_APPEND, SMASH_TOKEN_INPUT, SMASH_TOKEN_DUP,
+               SMASH_TOKEN_BACKGROUND };
+
+// A command line tokenized in a single pass: words (with quotes and escapes
+// resolved) and the &, |, |& operators and the redirections [n]>, [n]>>,
+// [n]<, [n]>&, [n]<&, &> and &>> (each followed by its file or fd word).
+class CommandLine {
+ public:
+  static const int OUT_AND_ERR = -1; // io_fd of &> and &>>
+
+  struct Token {
+    token_t type;
+    char* text;       // unquoted word, null for operators
+    size_t begin;     // [begin, end) is the raw text of the token in raw
+    size_t end;
+    int io_fd;        // redirections: the fd redirected (the n of n>)
+    bool has_glob;    // word contains an unquoted * or ?
+    bool needs_shell; // word uses syntax smash leaves to bash ($, `, ;, (), {}, ~)
+  };
 
-#define COMMAND_ARGS_MAX_LENGTH (200)
-#define COMMAND_MAX_ARGS (20)
+  std::string raw;
+  Arena arena;
+  Token* tokens;
+  int num_tokens;
+  int tokens_capacity;
+  int num_words;
+  bool is_background; // line ends with an unquoted &
+  bool has_glob;      // some word needs wildcard expansion
+  bool needs_shell;   // some word needs bash
+  int first_pipe;     // index of the first | or |& token, -1 if none
+  int first_redirect; // index of the first redirection token, -1 if none
+
+  explicit CommandLine(const char* cmd_line);
+  CommandLine(const CommandLine& parent, int first_token, int end_token);
+  void operator=(CommandLine const&) = delete;
+  ~CommandLine() = default;
+  std::string text(int first_token, int end_token) const;
+  const char* firstWord() const;
+
+ private:
+  Token* appendToken();
+  void updateFlags();
+};
 
 class Command {
  public:
   std::string cmd;
-  char* argv[COMMAND_MAX_ARGS];
+  char** argv; // null terminated, allocated in the arena of line
   int argc;
+  CommandLine* line; // owned by the command
 
-  Command(const char* cmd_line);
+  Command(CommandLine* line);
   virtual ~Command();
+  void expandGlobs();
   virtual void execute() = 0;
   //virtual void prepare();
   //virtual void cleanup();
@@ -22,50 +104,145 @@ class Command {
 
 class BuiltInCommand : public Command {
  public:
-  BuiltInCommand(const char* cmd_line);
+  BuiltInCommand(CommandLine* line);
   virtual ~BuiltInCommand() {};
 };
 
+// In-shell data mover for when smash itself sits between two fds (parallel
+// output, builtin output into a pipe). Bytes are moved with splice(2) or
+// sendfile(2) inside the kernel whenever the fd types allow it, and only
+// fall back to a read/write loop through userspace otherwise. Both
+// functions run until EOF on in_fd and return the bytes moved, or -1.
+class DataPump {
+ public:
+  static ssize_t pump(int in_fd, int out_fd);
+  static ssize_t copy(int in_fd, int out_fd);
+};
+
+enum launch_mode_t { SMASH_LAUNCH_SPAWN, SMASH_LAUNCH_FORK };
+
+// Absolute paths of external commands resolved from PATH, so a launch is a
+// single exec of a known file instead of execvp's walk over every PATH entry
+// (bash's "hash"). The whole cache is dropped when PATH changes and an entry
+// is dropped when its file can no longer be executed.
+class CommandPathCache {
+ public:
+  struct Entry {
+    std::string path;
+    unsigned long hits;
+  };
+  std::unordered_map<std::string, Entry> entries;
+  std::string path_env; // value of PATH the entries were resolved against
+
+  CommandPathCache() = default;
+  ~CommandPathCache() = default;
+  bool lookup(const std::string& name, std::string* path, bool count_hit = true);
+  void forget(const std::string& name);
+  void clear();
+  void print() const;
+};
+
+// Describes how an external process is started: the argv to exec, the
+// process group it joins and the fd rearrangements applied in the child
+// before exec (posix_spawn file actions, or plain syscalls on the fork path).
+class LaunchSpec {
+ public:
+  enum fd_action_t { SMASH_FD_DUP, SMASH_FD_CLOSE };
+  struct FdAction {
+    fd_action_t type;
+    int fd;            // target fd in the child
+    int src_fd;        // SMASH_FD_DUP: fd duplicated onto fd
+  };
+
+  char* const* argv;
+  pid_t pgid; // 0 means the child leads a new process group (like setpgrp)
+  std::vector<FdAction> fd_actions;
+  bool has_affinity; // pin the child to affinity before it execs
+  cpu_set_t affinity;
+
+  explicit LaunchSpec(char* const* argv);
+  static FdAction dupAction(int src_fd, int fd);
+  static FdAction closeAction(int fd);
+  void addDup(int src_fd, int fd);
+  void setAffinity(const cpu_set_t& cpus);
+};
+
+enum placement_t { SMASH_PLACE_OFF, SMASH_PLACE_RR, SMASH_PLACE_LEAST, SMASH_PLACE_NUMA };
+
+// Picks the cpus a new background job is pinned to ("setcore auto <policy>"):
+// the next cpu in turn, the cpu running the fewest jobs, or the first NUMA
+// node that still has a cpu per job (packing jobs onto as few nodes as
+// possible). Only cpus smash itself may run on are ever chosen.
+class CpuPlacement {
+ public:
+  placement_t policy;
+  int next_cpu; // round-robin position among the allowed cpus
+
+  CpuPlacement();
+  ~CpuPlacement() = default;
+  bool choose(cpu_set_t* cpus);
+  const char* policyName() const;
+};
+
 class ExternalCommand : public Command {
  public:
   bool is_background;
+  long timeout_ms; // kill the process after this long, -1 for no timeout
+  std::string complex_cmd; // argument of "bash -c" for complex commands
+  char* complex_args[4];
+  std::vector<LaunchSpec::FdAction> redirect_actions; // applied after the caller's (see RedirectionCommand)
   
-  ExternalCommand(const char* cmd_line);
+  ExternalCommand(CommandLine* line);
   virtual ~ExternalCommand() {}
   void execute() override;
+  pid_t launch(LaunchSpec& spec);
 };
 
 enum pipe_t { SMASH_REG_PIPE, SMASH_ERR_PIPE};
 
 class PipeCommand : public Command {
  public:
-  std::string pipe_cmd_1;
-  std::string pipe_cmd_2;
-  pipe_t type;
+  // one stage of the pipeline: tokens [first_token, end_token) of the line,
+  // type describes the pipe written by this stage
+  struct Stage {
+    int first_token;
+    int end_token;
+    pipe_t type;
+  };
+  std::vector<Stage> stages;
 
-  PipeCommand(const char* cmd_line);
+  PipeCommand(CommandLine* line);
   virtual ~PipeCommand() {}
   void execute() override;
 };
 
-enum redirection_t { SMASH_REG_REDIRECT, SMASH_APPEND_REDIRECT};
-
+// A command followed by its redirections ("cmd < in > out 2>&1"). No copy of
+// smash is forked: the files are opened by smash, an external command gets
+// them as spawn file actions and a built-in runs with smash's own fds
+// switched over, and restored once it is done.
 class RedirectionCommand : public Command {
  public:
-  std::string file_path;
-  redirection_t type;
-  std::string redirect_cmd;
-
-  explicit RedirectionCommand(const char* cmd_line);
-  virtual ~RedirectionCommand() {}
+  struct Redirect {
+    token_t type;       // SMASH_TOKEN_REDIRECT, _APPEND, _INPUT or _DUP
+    int fd;             // fd redirected, CommandLine::OUT_AND_ERR for &> and &>>
+    std::string target; // file, or the fd duplicated ("-" closes fd)
+  };
+  std::vector<Redirect> redirects;
+  Command* command; // the command without its redirections
+  bool is_valid;    // every redirection has its file or fd
+  std::vector<LaunchSpec::FdAction> fd_actions; // built by prepare(), applied in order
+  std::vector<int> opened_fds;
+
+  explicit RedirectionCommand(CommandLine* line);
+  virtual ~RedirectionCommand();
   void execute() override;
-  //void prepare() override;
-  //void cleanup() override;
+  bool prepare();
+  void cleanup();
 };
 
 class CHPromptCommand : public BuiltInCommand {
 public:
-  CHPromptCommand(const char* cmd_line);
+  CHPromptCommand(CommandLine* line);
   virtual ~CHPromptCommand() {};
   void execute() override;
 };
@@ -73,21 +250,21 @@ public:
 class ChangeDirCommand : public BuiltInCommand {
 
 public:
-  ChangeDirCommand(const char* cmd_line);
+  ChangeDirCommand(CommandLine* line);
   virtual ~ChangeDirCommand() {};
   void execute() override;
 };
 
 class GetCurrDirCommand : public BuiltInCommand {
  public:
-  GetCurrDirCommand(const char* cmd_line);
+  GetCurrDirCommand(CommandLine* line);
   virtual ~GetCurrDirCommand() {};
   void execute() override;
 };
 
 class ShowPidCommand : public BuiltInCommand {
  public:
-  ShowPidCommand(const char* cmd_line);
+  ShowPidCommand(CommandLine* line);
   virtual ~ShowPidCommand() {};
   void execute() override;
 };
@@ -96,12 +273,16 @@ class JobsList;
 class QuitCommand : public BuiltInCommand {
 // TODO: Add your data members
 public:
-  QuitCommand(const char* cmd_line, JobsList* jobs);
+  QuitCommand(CommandLine* line, JobsList* jobs);
   virtual ~QuitCommand() {}
   void execute() override;
 };
 
 
+// Jobs are heap allocated and never move, so a JobEntry* stays valid until
+// the job is removed. Lookup by job id and by pid goes through hash indexes,
+// and two intrusive lists ordered by job id thread the entries: all jobs
+// (for printing and max_job_id) and the stopped ones (for bg without args).
 class JobsList {
  public:
   class JobEntry {
@@ -110,35 +291,55 @@ class JobsList {
     std::string cmd;
     pid_t process_id;
     time_t entry_time;
-    bool is_stopped;
+    bool is_stopped; // read only outside of JobsList, use setJobStopped to change it
+    struct rusage usage; // as reported by the last wait4 on the job (when it stopped)
+    JobEntry* prev;
+    JobEntry* next;
+    JobEntry* prev_stopped;
+    JobEntry* next_stopped;
 
     JobEntry(int job_id, std::string cmd, pid_t process_id, time_t entry_time, bool is_stopped);
     ~JobEntry() = default;
 
-    void printEntry(time_t curr_time) const;
-    void resetTimerAndStop();
+    void printEntry(time_t curr_time, bool verbose = false) const;
+    void resetTimer();
   };
 
- std::vector<JobEntry> job_vector;
+ std::unordered_map<int, JobEntry*> jobs_by_id;
+ std::unordered_map<pid_t, JobEntry*> jobs_by_pid;
+ JobEntry* first_job; // all jobs, ordered by job id
+ JobEntry* last_job;
+ JobEntry* first_stopped; // stopped jobs, ordered by job id
+ JobEntry* last_stopped;
  int max_job_id;
 
  public:
   JobsList();
-  ~JobsList() = default;
+  JobsList(JobsList const&)      = delete;
+  void operator=(JobsList const&) = delete;
+  ~JobsList();
   void addJob(std::string cmd, pid_t pid, bool isStopped = false);
-  void printJobsList();
+  void printJobsList(bool verbose = false);
   void killAllJobs();
   void removeFinishedJobs();
+  void handleChildEvent(pid_t pid, pid_t pgid, int status, const struct rusage& usage);
   JobEntry * getJobById(int jobId);
+  JobEntry * getJobByPid(pid_t pid);
   void removeJobById(int jobId);
   JobEntry * getLastJob(int* lastJobId);
   JobEntry *getLastStoppedJob(int *jobId);
-  // TODO: Add extra methods or modify exisitng ones as needed
+  void setJobStopped(JobEntry* job, bool is_stopped);
+  size_t size() const;
+  bool empty() const;
+
+ private:
+  void linkStopped(JobEntry* job);
+  void unlinkStopped(JobEntry* job);
 };
 
 class JobsCommand : public BuiltInCommand {
  public:
-  JobsCommand(const char* cmd_line);
+  JobsCommand(CommandLine* line);
   virtual ~JobsCommand() {}
   void execute() override;
 };
@@ -146,59 +347,430 @@ class JobsCommand : public BuiltInCommand {
 class ForegroundCommand : public BuiltInCommand {
  // TODO: Add your data members
  public:
-  ForegroundCommand(const char* cmd_line);
+  ForegroundCommand(CommandLine* line);
   virtual ~ForegroundCommand() {}
   void execute() override;
 };
 
 class BackgroundCommand : public BuiltInCommand {
  public:
-  BackgroundCommand(const char* cmd_line);
+  BackgroundCommand(CommandLine* line);
   virtual ~BackgroundCommand() {}
   void execute() override;
 };
 
 class TimeoutCommand : public BuiltInCommand {
 /* Bonus */
-// TODO: Add your data members
  public:
-  explicit TimeoutCommand(const char* cmd_line);
+  explicit TimeoutCommand(CommandLine* line);
   virtual ~TimeoutCommand() {}
   void execute() override;
 };
 
+// time <command>: runs the command, then prints the real and cpu time,
+// peak memory, page faults and context switches it took
+class TimeCommand : public BuiltInCommand {
+ public:
+  explicit TimeCommand(CommandLine* line);
+  virtual ~TimeCommand() {}
+  void execute() override;
+};
+
+// cached <ttl> <command>: replays the output and exit status of command if it
+// already ran within the last ttl seconds, in the same directory and with
+// the files it names unchanged; "cached -s" prints the cache statistics and
+// "cached -c" empties the cache
+class CachedCommand : public BuiltInCommand {
+ public:
+  explicit CachedCommand(CommandLine* line);
+  virtual ~CachedCommand() {}
+  void execute() override;
+};
+
+// smashstat [on|off|reset|summary|dump]: controls the profiler, dump prints a Chrome trace
+class SmashStatCommand : public BuiltInCommand {
+ public:
+  explicit SmashStatCommand(CommandLine* line);
+  virtual ~SmashStatCommand() {}
+  void execute() override;
+};
+
+// history [count] | history -s <unix-time>: lists the last count entries,
+// or the entries entered since a time
+class HistoryCommand : public BuiltInCommand {
+ public:
+  explicit HistoryCommand(CommandLine* line);
+  virtual ~HistoryCommand() {}
+  void execute() override;
+};
+
 class ChmodCommand : public BuiltInCommand {
   // TODO: Add your data members
  public:
-  ChmodCommand(const char* cmd_line);
+  ChmodCommand(CommandLine* line);
   virtual ~ChmodCommand() {}
   void execute() override;
 };
 
+// getfiletype [-r] path...: prints the type and size of every path, found
+// with fstatat so nothing is opened. With -r a directory takes up the size
+// of its whole tree (symbolic links are not followed), walked with
+// getdents64 on a pool of threads, counting hard-linked files once. Several
+// paths or -r end with totals per type.
 class GetFileTypeCommand : public BuiltInCommand {
-  // TODO: Add your data members
+  struct Totals {
+    unsigned long count[16]; // indexed by the S_IFMT bits of the mode >> 12
+    unsigned long long bytes[16];
+  };
+  std::mutex walk_lock;
+  std::condition_variable walk_ready;
+  std::deque<std::pair<size_t, std::string>> walk_queue; // (path index, directory) left to read
+  int walk_busy;                    // workers reading a directory
+  std::vector<Totals> path_totals;  // per path, merged by the workers when they are done
+  std::mutex linked_lock;
+  std::set<std::pair<dev_t, ino_t>> linked_files; // seen files with several hard links
+
+  void addToTotals(Totals* totals, const struct stat& file_stat);
+  void walkWorker();
+  void readDirectory(const std::string& dir_path, Totals* totals, std::vector<std::string>* subdirs);
  public:
-  GetFileTypeCommand(const char* cmd_line);
+  GetFileTypeCommand(CommandLine* line);
   virtual ~GetFileTypeCommand() {}
   void execute() override;
 };
 
+class HashCommand : public BuiltInCommand {
+ public:
+  HashCommand(CommandLine* line);
+  virtual ~HashCommand() {}
+  void execute() override;
+};
+
 class SetcoreCommand : public BuiltInCommand {
   // TODO: Add your data members
  public:
-  SetcoreCommand(const char* cmd_line);
+  SetcoreCommand(CommandLine* line);
   virtual ~SetcoreCommand() {}
   void execute() override;
 };
 
+// parallel [-j N] [-p] command [args] ::: inputs  (or :::: file of inputs)
+// Runs the command once per input, {} in the command replaced by the input
+// (or the input appended when there is no {}), at most N at a time.
+class ParallelCommand : public BuiltInCommand {
+ public:
+  struct Job {
+    pid_t pid;
+    int output_fd; // memfd collecting the job's stdout until its turn to print
+    int slot;
+    bool done;
+  };
+  int max_jobs;
+  bool pin_workers;
+  std::string cmd_template;
+  std::vector<std::string> inputs;
+
+  ParallelCommand(CommandLine* line);
+  virtual ~ParallelCommand() {}
+  void execute() override;
+  bool parseArgs();
+  bool startJob(size_t input_idx, Job& job, pid_t pgid, const std::vector<int>& cpus);
+};
+
 class KillCommand : public BuiltInCommand {
  // TODO: Add your data members
  public:
-  KillCommand(const char* cmd_line);
+  KillCommand(CommandLine* line);
   virtual ~KillCommand() {}
   void execute() override;
 };
 
+// Deadlines of running "timeout" commands. The set ordered by deadline works
+// as a min-heap that also supports O(log n) cancel, and a single timerfd
+// (watched by the event loop) is always armed for the earliest deadline
+// only, so any number of timeouts can be pending at once.
+class TimerQueue {
+ public:
+  struct Timer {
+    long deadline_ms; // CLOCK_MONOTONIC
+    std::string cmd;
+  };
+  std::set<std::pair<long, pid_t>> deadlines;
+  std::unordered_map<pid_t, Timer> timers;
+  int timer_fd;
+
+  TimerQueue();
+  TimerQueue(TimerQueue const&)      = delete;
+  void operator=(TimerQueue const&)  = delete;
+  ~TimerQueue();
+  void arm(pid_t pid, long timeout_ms, const std::string& cmd);
+  void cancel(pid_t pid);
+  void expire();
+
+ private:
+  void rearm();
+};
+
+// Reads the command lines smash executes. Script files (and stdin when it is
+// a regular file) are mapped whole; pipes and terminals are read in large
+// chunks. fill() and nextLine() are split so callers can read without
+// blocking; readLine() is the blocking combination of both.
+class LineReader {
+  int fd;
+  char* data;       // mapped file, or the chunk buffer
+  size_t capacity;  // size of the mapping / buffer
+  size_t begin;     // first unconsumed byte
+  size_t end;       // end of the valid bytes
+  bool is_mapped;
+  bool eof;
+
+ public:
+  static const size_t CHUNK_SIZE = 1 << 16;
+
+  explicit LineReader(int fd);
+  LineReader(LineReader const&)      = delete;
+  void operator=(LineReader const&)  = delete;
+  ~LineReader();
+  ssize_t fill();
+  bool nextLine(std::string& line);
+  bool readLine(std::string& line);
+  bool atEof() const;
+  void syncOffset();
+};
+
+enum trace_phase_t { SMASH_PHASE_COMMAND, SMASH_PHASE_PARSE, SMASH_PHASE_CREATE,
+                     SMASH_PHASE_REAP, SMASH_PHASE_SPAWN, SMASH_PHASE_WAIT, SMASH_NUM_PHASES };
+
+// Timestamps of the phases of every command, kept in a fixed ring of the
+// most recent RING_SIZE spans. Recording a span is two vDSO clock reads and
+// one atomic increment, no allocation or I/O, so it can stay enabled;
+// "smashstat" prints the ring and SMASH_TRACE_FILE gets it as a Chrome
+// trace (chrome://tracing, Perfetto) when smash exits.
+class Profiler {
+ public:
+  struct Span {
+    long begin_ns; // CLOCK_MONOTONIC
+    long end_ns;
+    trace_phase_t phase;
+  };
+  static const unsigned long RING_SIZE = 1 << 14; // a power of two
+
+  Span ring[RING_SIZE];
+  std::atomic<unsigned long> next_span; // total spans recorded, the ring keeps the last RING_SIZE
+  bool enabled;
+  std::string trace_file; // written at exit if not empty
+  pid_t owner_pid; // forked copies of smash don't write the trace file
+
+  Profiler();
+  Profiler(Profiler const&)        = delete;
+  void operator=(Profiler const&)  = delete;
+  ~Profiler();
+  static long now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+  }
+  void record(trace_phase_t phase, long begin_ns, long end_ns) {
+    Span& span = ring[next_span.fetch_add(1, std::memory_order_relaxed) & (RING_SIZE - 1)];
+    span.begin_ns = begin_ns;
+    span.end_ns = end_ns;
+    span.phase = phase;
+  }
+  void reset();
+  void printSummary(std::ostream& out) const;
+  void writeChromeTrace(std::ostream& out) const;
+};
+
+// Records the span from its construction to end() (or its destruction).
+class TraceSpan {
+  Profiler& profiler;
+  trace_phase_t phase;
+  long begin_ns; // -1 when the profiler was off at construction
+
+ public:
+  TraceSpan(Profiler& profiler, trace_phase_t phase) :
+    profiler(profiler), phase(phase), begin_ns(profiler.enabled ? Profiler::now() : -1) {}
+  TraceSpan(TraceSpan const&)       = delete;
+  void operator=(TraceSpan const&)  = delete;
+  ~TraceSpan() { end(); }
+  void end() {
+    if(begin_ns < 0) return;
+    profiler.record(phase, begin_ns, Profiler::now());
+    begin_ns = -1;
+  }
+};
+
+// Results of commands run through "cached": stdout, stderr and exit status,
+// keyed by the command line, the cwd and the mtimes of the files named by
+// the arguments. An LRU list with a hash index, bounded by entries and by
+// bytes. With SMASH_CACHE_DIR set every entry is also written to a file
+// there, so it outlives eviction and smash itself (batch runs share it).
+class ResultCache {
+ public:
+  struct Entry {
+    std::string key;
+    std::string out;
+    std::string err;
+    int status;
+    long run_us;     // how long the command took, what each hit saves
+    long expires_ms; // CLOCK_REALTIME, entries on disk outlive smash
+  };
+  static const size_t MAX_ENTRIES = 256;
+  static const size_t MAX_BYTES = 64 << 20;
+  static const size_t MAX_ENTRY_BYTES = 8 << 20; // larger results aren't cached
+
+  std::list<Entry> entries; // most recently used first
+  std::unordered_map<std::string, std::list<Entry>::iterator> index;
+  size_t bytes;
+  std::string spill_dir;
+  unsigned long hits;
+  unsigned long disk_hits;
+  unsigned long misses;
+  long saved_us;
+
+  ResultCache();
+  ResultCache(ResultCache const&)     = delete;
+  void operator=(ResultCache const&)  = delete;
+  ~ResultCache() = default;
+  const Entry* lookup(const std::string& key);
+  void store(const Entry& entry);
+  void clear();
+  void printStats(std::ostream& out) const;
+
+ private:
+  void insert(const Entry& entry);
+  void erase(std::list<Entry>::iterator it);
+  std::string spillPath(const std::string& key) const;
+  bool readSpilled(const std::string& key, Entry* entry) const;
+  void spill(const Entry& entry) const;
+};
+
+// Command history shared by every smash of the user: an append-only log
+// with one command per line (~/.smash_history, or $SMASH_HISTFILE) and an
+// index of fixed size records (the log's name + ".idx") giving the offset
+// and time of every entry, so entry n is found without scanning the log.
+// Both files are mapped on demand and only remapped when they grew; an
+// append is two O_APPEND writes under flock, so concurrent shells never
+// interleave entries. Entries are numbered from 1.
+class History {
+ public:
+  struct IndexRecord {
+    int64_t offset; // of the command in the log
+    int64_t time;   // when it was entered, non-decreasing over the index
+  };
+
+  std::string log_path;
+  int log_fd;
+  int index_fd;
+  const char* log_map;
+  size_t log_map_size;
+  const IndexRecord* index_map;
+  size_t index_map_size;
+  // prefix index, built on the first !prefix and then extended with the
+  // entries appended since: a radix tree of the commands where every node
+  // keeps the latest entry below it, so !prefix walks the prefix once
+  struct PrefixNode {
+    std::string label; // characters on the edge into the node
+    std::vector<std::pair<char, int>> children; // by first label character, sorted
+    long latest;
+  };
+  std::vector<PrefixNode> prefix_nodes; // [0] is the root
+  long prefix_indexed; // entries already in prefix_nodes
+
+  History();
+  History(History const&)          = delete;
+  void operator=(History const&)   = delete;
+  ~History();
+  bool open();
+  bool isOpen() const;
+  void add(const std::string& cmd_line);
+  long size();
+  std::string entry(long n);
+  time_t entryTime(long n);
+  long findPrefix(const std::string& prefix);
+  long findTime(time_t time);
+  bool expand(std::string& cmd_line);
+
+ private:
+  bool remap();
+  int prefixChild(int node, char c) const;
+  void indexPrefix(const std::string& command, long n);
+};
+
+// Names of the executables in the PATH directories, as a trie for prefix
+// completion. Built on first use and rebuilt only when PATH or the mtime
+// of one of its directories changed (a file was added, removed or renamed).
+class ExecutableTrie {
+ public:
+  struct Node {
+    std::vector<std::pair<char, int>> children; // sorted by character
+    bool is_name;
+  };
+  struct PathDir {
+    std::string path;
+    struct timespec mtime;
+  };
+  std::vector<Node> nodes; // nodes[0] is the root
+  std::string path_env;    // PATH the trie was built from
+  std::vector<PathDir> dirs;
+
+  ExecutableTrie();
+  ~ExecutableTrie() = default;
+  void refresh();
+  void insert(const char* name);
+  std::string extend(const std::string& prefix) const;
+  void collect(const std::string& prefix, std::vector<std::string>* names, size_t limit) const;
+
+ private:
+  int find(const std::string& prefix) const;
+};
+
+enum edit_result_t { SMASH_EDIT_MORE, SMASH_EDIT_LINE, SMASH_EDIT_EOF };
+
+// Line editing for an interactive terminal. The terminal is put in raw
+// mode (ISIG stays on, so ctrl-C/ctrl-Z still reach the signalfd) while a
+// line is edited, and restored before the command runs. Input is fed one
+// byte at a time, so the editor doesn't care where the bytes come from.
+// Keys: arrows, home/end, delete, backspace, ctrl-A/E/B/F/K/U/W/L, ctrl-D,
+// up/down through the history, and tab completion of built-ins,
+// executables, job ids (after fg, bg, kill and setcore) and paths.
+class LineEditor {
+ public:
+  enum key_state_t { SMASH_KEY_NORMAL, SMASH_KEY_ESC, SMASH_KEY_CSI };
+  static const size_t LIST_LIMIT = 200; // candidates listed on an ambiguous completion
+
+  std::string prompt;
+  std::string buffer;
+  size_t cursor;
+  key_state_t key_state;
+  std::string csi_params; // parameters of the escape sequence being read
+  bool is_raw;
+  struct termios saved_termios;
+  long history_pos;       // entry shown while browsing the history, 0 when editing
+  std::string edited_line; // line being edited before browsing the history started
+  std::string pending_input; // bytes read past the end of the last line (typed ahead, pasted)
+  ExecutableTrie executables;
+
+  LineEditor();
+  LineEditor(LineEditor const&)     = delete;
+  void operator=(LineEditor const&) = delete;
+  ~LineEditor();
+  bool begin(const std::string& prompt);
+  edit_result_t feed(char c, std::string* line);
+  void end();
+  bool readLine(const std::string& prompt, std::string* line);
+  void redraw();
+  void output(const std::string& text);
+
+ private:
+  edit_result_t feedKey(char c, std::string* line);
+  void feedEscape(char c);
+  void insert(const std::string& text);
+  void erase(size_t begin, size_t end);
+  void showHistory(long n);
+  void complete();
+};
+
 class SmallShell {
   SmallShell();
 
@@ -206,13 +778,40 @@ class SmallShell {
   std::string last_pwd;
   std::string prompt;
   JobsList jobs;
-  pid_t curr_fg_pid; // id of process currently running in foreground
+  pid_t curr_fg_pid; // process group currently running in foreground (its leader's pid)
   std::string curr_fg_cmd; // cmd line of process currently running in foreground
   int curr_fg_jobid; // job id of process currently running in foreground (optional)
-  bool forked_from_smash; // true if forked as part of redirect/pipe
   pid_t smash_pid;
+  launch_mode_t launch_mode; // how external commands are started (SMASH_LAUNCH env)
+  // event loop: the shell signals arrive on signal_fd, and epoll_fd watches
+  // it together with the timeout timerfd and the input being read
+  sigset_t shell_signals;
+  int signal_fd;
+  int epoll_fd;
+  int input_watched; // input fd armed (one-shot) in epoll_fd, -1 if none
+  bool got_sigchld; // children changed state since the last reap
+  // children that are no job, reaped by removeFinishedJobs before their
+  // foreground waiter (e.g. a pipeline stage) got to them; waitChild
+  // returns these first, whatever is left is dropped after the command
+  struct ReapedChild {
+    pid_t pgid;
+    int status;
+    struct rusage usage;
+  };
+  std::unordered_map<pid_t, ReapedChild> reaped_children;
+  bool notify_jobs; // report finished background jobs as they finish (interactive)
+  CommandPathCache path_cache;
+  TimerQueue timers;
+  CpuPlacement placement;
+  struct rusage fg_usage; // resources of the foreground processes waited for, summed (see "time")
+  Profiler profiler;
+  History history;
+  ResultCache result_cache;
+  LineEditor editor;
+  int last_status; // exit status of the last command, returned by smash in batch mode
 
   Command *CreateCommand(const char* cmd_line);
+  Command *CreateCommand(CommandLine* line);
   SmallShell(SmallShell const&)      = delete; // disable copy ctor
   void operator=(SmallShell const&)  = delete; // disable = operator
   static SmallShell& getInstance() // make SmallShell singleton
@@ -223,6 +822,13 @@ class SmallShell {
   }
   ~SmallShell();
   void executeCommand(const char* cmd_line);
+  pid_t launchProcess(const LaunchSpec& spec);
+  bool initEvents(const sigset_t& signals);
+  bool waitEvents(int input_fd, int timeout_ms);
+  void handleSignals();
+  void handleTimers();
+  pid_t waitChild(pid_t pid, int* status, int options, struct rusage* usage);
+  int run(int input_fd, bool interactive, bool use_editor);
 
   // new added methods
   std::string getPromptMessage() const;
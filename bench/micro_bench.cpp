@@ -0,0 +1,193 @@
+// Micro-benchmarks of smash internals, linked against Commands.cpp. Prints
+// one JSON object per measurement (JSON Lines), like smash_bench.
+//
+// - lexer:    CommandLine against the istringstream tokenizer smash used
+//             before the single-pass lexer (kept below as the baseline)
+// - classify: SmallShell::CreateCommand (lexing, built-in lookup, command
+//             construction) per line
+// - pump:     DataPump::pump against a plain read/write loop, file to file
+//             and pipe to file
+//
+// SMASH_BENCH_MB sets the amount of data pumped (default 1024).
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/wait.h>
+#include "Commands.h"
+
+using namespace std;
+
+const int NUM_LINES = 1000000;
+
+const char* SAMPLE_LINES[] = {
+  "pwd",
+  "ls -l /tmp",
+  "cat file.txt | grep foo | wc -l",
+  "sleep 10 &",
+  "echo \"hello world\" > out.txt",
+  "gcc -O2 -Wall -o prog main.c util.c parser.c lexer.c",
+};
+const int NUM_SAMPLES = sizeof(SAMPLE_LINES) / sizeof(SAMPLE_LINES[0]);
+
+double _now() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+void _report(const char* name, const char* variant, double seconds, double ops, const char* unit) {
+  cout << "{\"bench\":\"" << name << "\",\"variant\":\"" << variant << "\""
+       << ",\"seconds\":" << seconds << ",\"" << unit << "\":" << ops / seconds << "}" << endl;
+}
+
+// ---------------- baseline tokenizer (smash before the single-pass lexer) ---------------- //
+const string WHITESPACE = " \n\r\t\f\v";
+
+string _legacyTrim(const string& s) {
+  size_t start = s.find_first_not_of(WHITESPACE);
+  if(start == string::npos) return "";
+  size_t end = s.find_last_not_of(WHITESPACE);
+  return s.substr(start, end - start + 1);
+}
+
+int _legacyParseCommandLine(const char* cmd_line, char** args) {
+  int i = 0;
+  istringstream iss(_legacyTrim(string(cmd_line)).c_str());
+  for(string s; iss >> s; ) {
+    args[i] = (char*)malloc(s.length() + 1);
+    memset(args[i], 0, s.length() + 1);
+    strcpy(args[i], s.c_str());
+    args[++i] = NULL;
+  }
+  return i;
+}
+
+void benchLexer() {
+  char* args[64];
+  volatile long words = 0;
+
+  double start = _now();
+  for(int i = 0; i < NUM_LINES; ++i) {
+    int argc = _legacyParseCommandLine(SAMPLE_LINES[i % NUM_SAMPLES], args);
+    words += argc;
+    for(int j = 0; j < argc; ++j) free(args[j]);
+  }
+  _report("lexer", "istringstream", _now() - start, NUM_LINES, "lines_per_sec");
+
+  start = _now();
+  for(int i = 0; i < NUM_LINES; ++i) {
+    CommandLine line(SAMPLE_LINES[i % NUM_SAMPLES]);
+    words += line.num_words;
+  }
+  _report("lexer", "CommandLine", _now() - start, NUM_LINES, "lines_per_sec");
+}
+
+void benchClassify() {
+  SmallShell& smash = SmallShell::getInstance();
+  double start = _now();
+  for(int i = 0; i < NUM_LINES; ++i) {
+    Command* cmd = smash.CreateCommand(SAMPLE_LINES[i % NUM_SAMPLES]);
+    delete cmd;
+  }
+  _report("classify", "CreateCommand", _now() - start, NUM_LINES, "lines_per_sec");
+}
+
+// ---------------- pump ---------------- //
+ssize_t _readWriteCopy(int in_fd, int out_fd) {
+  static char buf[1 << 16];
+  ssize_t total = 0;
+  ssize_t bytes_read;
+  while((bytes_read = read(in_fd, buf, sizeof(buf))) > 0) {
+    for(ssize_t written = 0; written < bytes_read; ) {
+      ssize_t n = write(out_fd, buf + written, bytes_read - written);
+      if(n < 0) return -1;
+      written += n;
+    }
+    total += bytes_read;
+  }
+  return bytes_read < 0 ? -1 : total;
+}
+
+// a child writes size_mb MB into a pipe, returns its read end
+int _startPipeWriter(long size_mb, pid_t* writer) {
+  int pipe_fd[2];
+  if(pipe(pipe_fd) < 0) return -1;
+  if((*writer = fork()) == 0) {
+    close(pipe_fd[0]);
+    vector<char> chunk(1 << 20, 'x');
+    for(long i = 0; i < size_mb; ++i) {
+      for(size_t written = 0; written < chunk.size(); ) {
+        ssize_t n = write(pipe_fd[1], chunk.data() + written, chunk.size() - written);
+        if(n < 0) _exit(1);
+        written += n;
+      }
+    }
+    _exit(0);
+  }
+  close(pipe_fd[1]);
+  return pipe_fd[0];
+}
+
+void benchPump(long size_mb, const string& dir) {
+  string src_path = dir + "/src";
+  string dst_path = dir + "/dst";
+  double bytes = size_mb * 1048576.0;
+
+  int src = open(src_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  vector<char> chunk(1 << 20, 'x');
+  for(long i = 0; i < size_mb; ++i) {
+    if(write(src, chunk.data(), chunk.size()) < 0) {
+      perror("micro_bench: write failed");
+      break;
+    }
+  }
+  close(src);
+
+  for(int variant = 0; variant < 2; ++variant) {
+    int in_fd = open(src_path.c_str(), O_RDONLY);
+    int out_fd = open(dst_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    double start = _now();
+    ssize_t moved = variant == 0 ? _readWriteCopy(in_fd, out_fd) : DataPump::pump(in_fd, out_fd);
+    double seconds = _now() - start;
+    close(in_fd);
+    close(out_fd);
+    if(moved >= 0) _report("pump_file_to_file", variant == 0 ? "read_write" : "DataPump", seconds, bytes / 1048576.0, "mb_per_sec");
+
+    pid_t writer;
+    in_fd = _startPipeWriter(size_mb, &writer);
+    out_fd = open(dst_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    start = _now();
+    moved = variant == 0 ? _readWriteCopy(in_fd, out_fd) : DataPump::pump(in_fd, out_fd);
+    seconds = _now() - start;
+    close(in_fd);
+    close(out_fd);
+    waitpid(writer, nullptr, 0);
+    if(moved >= 0) _report("pump_pipe_to_file", variant == 0 ? "read_write" : "DataPump", seconds, bytes / 1048576.0, "mb_per_sec");
+  }
+  unlink(src_path.c_str());
+  unlink(dst_path.c_str());
+}
+
+int main() {
+  const char* size_env = getenv("SMASH_BENCH_MB");
+  long size_mb = size_env ? atol(size_env) : 1024;
+  if(size_mb <= 0) size_mb = 1;
+
+  char dir_template[] = "/tmp/smash-micro-XXXXXX";
+  if(mkdtemp(dir_template) == nullptr) {
+    perror("micro_bench: mkdtemp failed");
+    return 1;
+  }
+
+  benchLexer();
+  benchClassify();
+  benchPump(size_mb, dir_template);
+  rmdir(dir_template);
+  return 0;
+}
@@ -0,0 +1,215 @@
+// Drives a smash binary through generated batch-mode workloads and prints
+// one JSON object per workload (JSON Lines), e.g.
+//   {"workload":"builtins","commands":100000,"seconds":1.52,"cmds_per_sec":65789,
+//    "p50_us":8.1,"p99_us":21.4,"peak_rss_kb":3712}
+//
+// usage: smash_bench <path to smash>
+// SMASH_BENCH_MB sets the size of the data file used by the pipeline and
+// redirection workloads (default 1024).
+//
+// Per-command latency comes from smash's own profiler: every run sets
+// SMASH_TRACE_FILE and the "command" spans of the trace are used, so the
+// percentiles cover the last 16384 spans the profiler keeps. Peak RSS is
+// the ru_maxrss wait4 reports for smash (and the children it waited for).
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+using namespace std;
+
+struct RunResult {
+  double seconds;
+  long peak_rss_kb;
+  vector<double> latencies_us;
+  bool ok;
+};
+
+string tmp_dir;
+
+double _now() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+void _writeScript(const string& path, const vector<string>& lines) {
+  ofstream out(path.c_str());
+  for(auto it = lines.begin(); it != lines.end(); ++it) {
+    out << *it << "\n";
+  }
+}
+
+// durations of the "command" spans of a Chrome trace written by smash
+vector<double> _commandLatencies(const string& trace_path) {
+  vector<double> latencies;
+  ifstream in(trace_path.c_str());
+  string event;
+  while(getline(in, event)) {
+    if(event.find("\"name\":\"command\"") == string::npos) continue;
+    size_t dur = event.find("\"dur\":");
+    if(dur != string::npos) latencies.push_back(atof(event.c_str() + dur + 6));
+  }
+  return latencies;
+}
+
+RunResult _runSmash(const string& smash, const string& script, const char* launch_mode) {
+  RunResult result = {0, 0, vector<double>(), false};
+  string trace_path = tmp_dir + "/trace.json";
+  unlink(trace_path.c_str());
+
+  double start = _now();
+  pid_t pid = fork();
+  if(pid < 0) {
+    perror("smash_bench: fork failed");
+    return result;
+  }
+  if(pid == 0) {
+    setenv("SMASH_TRACE_FILE", trace_path.c_str(), 1);
+    setenv("SMASH_LAUNCH", launch_mode, 1);
+    int null_fd = open("/dev/null", O_RDWR);
+    dup2(null_fd, 0);
+    dup2(null_fd, 1);
+    execl(smash.c_str(), smash.c_str(), script.c_str(), (char*)nullptr);
+    perror("smash_bench: exec failed");
+    _exit(127);
+  }
+
+  int status;
+  struct rusage usage;
+  if(wait4(pid, &status, 0, &usage) < 0) {
+    perror("smash_bench: wait4 failed");
+    return result;
+  }
+  result.seconds = _now() - start;
+  result.peak_rss_kb = usage.ru_maxrss;
+  result.latencies_us = _commandLatencies(trace_path);
+  result.ok = WIFEXITED(status) && WEXITSTATUS(status) != 127;
+  return result;
+}
+
+double _percentile(vector<double>& values, double p) {
+  if(values.empty()) return 0;
+  sort(values.begin(), values.end());
+  size_t idx = min(values.size() - 1, (size_t)(values.size() * p));
+  return values[idx];
+}
+
+void _report(const string& name, const string& smash, const vector<string>& lines,
+             const char* launch_mode = "spawn", long bytes_moved = 0) {
+  string script = tmp_dir + "/" + name + ".smash";
+  _writeScript(script, lines);
+  RunResult result = _runSmash(smash, script, launch_mode);
+
+  ostringstream json;
+  json << "{\"workload\":\"" << name << "\",\"launch\":\"" << launch_mode << "\""
+       << ",\"commands\":" << lines.size()
+       << ",\"seconds\":" << result.seconds
+       << ",\"cmds_per_sec\":" << (result.seconds > 0 ? lines.size() / result.seconds : 0)
+       << ",\"p50_us\":" << _percentile(result.latencies_us, 0.50)
+       << ",\"p99_us\":" << _percentile(result.latencies_us, 0.99)
+       << ",\"peak_rss_kb\":" << result.peak_rss_kb;
+  if(bytes_moved > 0) {
+    json << ",\"mb_per_sec\":" << (result.seconds > 0 ? bytes_moved / 1048576.0 / result.seconds : 0);
+  }
+  json << ",\"ok\":" << (result.ok ? "true" : "false") << "}";
+  cout << json.str() << endl;
+}
+
+bool _makeDataFile(const string& path, long size_mb) {
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd < 0) {
+    perror("smash_bench: open failed");
+    return false;
+  }
+  vector<char> chunk(1 << 20);
+  for(size_t i = 0; i < chunk.size(); ++i) chunk[i] = i % 64 == 63 ? '\n' : 'a' + i % 26;
+  for(long i = 0; i < size_mb; ++i) {
+    if(write(fd, chunk.data(), chunk.size()) != (ssize_t)chunk.size()) {
+      perror("smash_bench: write failed");
+      close(fd);
+      return false;
+    }
+  }
+  close(fd);
+  return true;
+}
+
+int main(int argc, char* argv[]) {
+  if(argc != 2) {
+    cerr << "usage: smash_bench <path to smash>\n";
+    return 2;
+  }
+  string smash = argv[1];
+  if(smash.find('/') == string::npos) smash = "./" + smash;
+  const char* size_env = getenv("SMASH_BENCH_MB");
+  long size_mb = size_env ? atol(size_env) : 1024;
+  if(size_mb <= 0) size_mb = 1;
+
+  char dir_template[] = "/tmp/smash-bench-XXXXXX";
+  if(mkdtemp(dir_template) == nullptr) {
+    perror("smash_bench: mkdtemp failed");
+    return 1;
+  }
+  tmp_dir = dir_template;
+
+  // 100k built-ins: lexing, dispatch and execution inside smash only
+  const char* builtins[] = { "pwd", "showpid", "chprompt bench", "cd .", "jobs" };
+  vector<string> lines;
+  for(int i = 0; i < 100000; ++i) lines.push_back(builtins[i % 5]);
+  _report("builtins", smash, lines);
+
+  // 10k externals, with both launch engines
+  lines.assign(10000, "/bin/true");
+  _report("externals", smash, lines, "spawn");
+  _report("externals", smash, lines, "fork");
+
+  // job table churn: background jobs started, reaped and listed
+  lines.clear();
+  for(int i = 1; i <= 5000; ++i) {
+    lines.push_back("/bin/true &");
+    if(i % 50 == 0) lines.push_back("jobs");
+  }
+  _report("job_churn", smash, lines);
+
+  // the same churn next to a big table of jobs that keep running: reaping
+  // must cost per child event, not per job in the table
+  lines.assign(2000, "/bin/sleep 30 &");
+  for(int i = 1; i <= 200; ++i) {
+    lines.push_back("/bin/true &");
+    if(i % 50 == 0) lines.push_back("jobs");
+  }
+  lines.push_back("quit kill");
+  _report("job_churn_2000_running", smash, lines);
+
+  string data_path = tmp_dir + "/data";
+  if(_makeDataFile(data_path, size_mb)) {
+    long data_bytes = size_mb * 1048576L;
+    int stage_counts[] = { 2, 4, 8 };
+    for(int i = 0; i < 3; ++i) {
+      string pipeline = "cat " + data_path;
+      for(int stage = 2; stage < stage_counts[i]; ++stage) pipeline += " | cat";
+      pipeline += " | wc -c";
+      lines.assign(1, pipeline);
+      _report("pipeline_" + to_string(stage_counts[i]), smash, lines, "spawn", data_bytes);
+    }
+
+    lines.assign(1, "cat " + data_path + " > " + tmp_dir + "/copy");
+    _report("redirection", smash, lines, "spawn", data_bytes);
+  }
+
+  string cleanup = "rm -rf " + tmp_dir;
+  if(system(cleanup.c_str()) != 0) {
+    cerr << "smash_bench: could not remove " << tmp_dir << "\n";
+  }
+  return 0;
+}
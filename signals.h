@@ -1,8 +1,8 @@
 #ifndef SMASH__SIGNALS_H_
 #define SMASH__SIGNALS_H_
 
-void ctrlZHandler(int sig_num);
-void ctrlCHandler(int sig_num);
-void alarmHandler(int sig_num);
+#include <signal.h>
+
+void shellSignals(sigset_t* signals);
 
 #endif //SMASH__SIGNALS_H_
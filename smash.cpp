@@ -1,26 +1,72 @@
 #include <iostream>
 #include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
 #include <sys/wait.h>
 #include <signal.h>
 #include "Commands.h"
 #include "signals.h"
 
+void printUsage() {
+    std::cerr << "usage: smash [-i] [-c command | script]\n";
+}
+
 int main(int argc, char* argv[]) {
-    if(signal(SIGTSTP , ctrlZHandler)==SIG_ERR) {
-        perror("smash error: failed to set ctrl-Z handler");
+    SmallShell& smash = SmallShell::getInstance();
+
+    // signals are read from a signalfd by the event loop, see signals.cpp
+    sigset_t signals;
+    shellSignals(&signals);
+    smash.initEvents(signals);
+
+    // smash [-i] [-c command | script]: with no script, commands come from
+    // stdin, and the prompt is shown only when stdin is a terminal (or -i)
+    const char* command = nullptr;
+    const char* script = nullptr;
+    bool force_interactive = false;
+    for(int i = 1; i < argc; ++i) {
+        if(strcmp(argv[i], "-i") == 0) {
+            force_interactive = true;
+        } else if(strcmp(argv[i], "-c") == 0 && i + 1 < argc && !command && !script) {
+            command = argv[++i];
+        } else if(argv[i][0] != '-' && !command && !script) {
+            script = argv[i];
+        } else {
+            printUsage();
+            return 2;
+        }
     }
-    if(signal(SIGINT , ctrlCHandler)==SIG_ERR) {
-        perror("smash error: failed to set ctrl-C handler");
+
+    if(command) {
+        // a -c argument may hold several lines, run them in order
+        std::string lines(command);
+        size_t line_start = 0;
+        while(line_start <= lines.length()) {
+            size_t line_end = lines.find('\n', line_start);
+            if(line_end == std::string::npos) line_end = lines.length();
+            smash.executeCommand(lines.substr(line_start, line_end - line_start).c_str());
+            std::cout.flush();
+            line_start = line_end + 1;
+        }
+        return smash.last_status;
     }
 
-    //TODO: setup sig alarm handler
+    int input_fd = STDIN_FILENO;
+    if(script) {
+        if((input_fd = open(script, O_RDONLY | O_CLOEXEC)) < 0) {
+            perror("smash error: open failed");
+            return 127;
+        }
+    }
+    bool interactive = force_interactive || (!script && isatty(STDIN_FILENO));
 
-    SmallShell& smash = SmallShell::getInstance();
-    while(true) {
-        std::cout << smash.getPromptMessage() << "> ";
-        std::string cmd_line;
-        std::getline(std::cin, cmd_line);
-        smash.executeCommand(cmd_line.c_str());
+    // like bash, only interactive shells record and recall history
+    if(interactive) {
+        smash.history.open();
     }
-    return 0;
+
+    // a terminal on both ends gets the line editor, anything else plain lines
+    bool use_editor = interactive && !script && isatty(STDIN_FILENO) && isatty(STDOUT_FILENO);
+
+    return smash.run(input_fd, interactive, use_editor);
 }
\ No newline at end of file